@@ -14,20 +14,142 @@
 int client_colors[FD_SETSIZE] = {0};
 int user_cnt = 0;
 
+/* Bytes a client has not been able to take yet. A non-blocking write() may
+ * accept only part of a message (or nothing, with EAGAIN), so the rest waits
+ * here until select() reports the socket writable. The buffer grows as it
+ * fills, so a client that keeps up costs nothing.
+ *
+ * A client with more than sendq_high bytes pending is too slow. With -p drop
+ * its oldest lines are thrown away until sendq_low bytes are left (it misses
+ * some chat, but stays connected); with -p evict it is disconnected.
+ */
+enum { SLOW_DROP_OLDEST, SLOW_EVICT };
+static size_t sendq_high = 256 * 1024;
+static size_t sendq_low = 64 * 1024;
+static int slow_policy = SLOW_DROP_OLDEST;
+
+char *pending[FD_SETSIZE];
+size_t pending_len[FD_SETSIZE];
+size_t pending_cap[FD_SETSIZE];
+
+static void drop_pending(int fd)
+{
+    free(pending[fd]);
+    pending[fd] = NULL;
+    pending_len[fd] = 0;
+    pending_cap[fd] = 0;
+}
+
+/* Write as much of the pending data as the socket takes.
+ * Returns -1 on a real write error. */
+static int flush_pending(int fd)
+{
+    while (pending_len[fd] > 0) {
+        ssize_t n = write(fd, pending[fd], pending_len[fd]);
+        if (n < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        memmove(pending[fd], pending[fd] + n, pending_len[fd] - n);
+        pending_len[fd] -= n;
+    }
+    return 0;
+}
 
-
-
+/* Throw away whole lines after the first, oldest first, until at most
+ * target bytes are pending. The first line may be half written already,
+ * so it stays. */
+static void drop_oldest(int fd, size_t target)
+{
+    char *first = memchr(pending[fd], '\n', pending_len[fd]);
+    if (!first)
+        return;
+    char *keep = first + 1, *from = keep, *end = pending[fd] + pending_len[fd];
+    while ((size_t) (end - from) + (keep - pending[fd]) > target) {
+        char *nl = memchr(from, '\n', end - from);
+        if (!nl)
+            break;
+        from = nl + 1;
+    }
+    fprintf(stderr, "[%d] too slow, dropped %zu bytes\n", fd, (size_t) (from - keep));
+    memmove(keep, from, end - from);
+    pending_len[fd] -= from - keep;
+}
+
+/* Send a message after whatever is already pending, keeping the stream in
+ * order. Returns -1 if the client must be disconnected. */
+static int send_or_queue(int fd, const char *msg, size_t len)
+{
+    if (pending_len[fd] == 0) {
+        ssize_t n = write(fd, msg, len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            n = 0;
+        }
+        msg += n;
+        len -= n;
+        if (len == 0)
+            return 0;
+    }
+    if (pending_len[fd] + len > sendq_high && slow_policy == SLOW_EVICT) {
+        fprintf(stderr, "[%d] too slow, %zu bytes pending\n", fd,
+                pending_len[fd] + len);
+        return -1;
+    }
+    if (pending_len[fd] + len > pending_cap[fd]) {
+        size_t cap = pending_cap[fd] ? pending_cap[fd] * 2 : 4096;
+        while (cap < pending_len[fd] + len)
+            cap *= 2;
+        char *buf = realloc(pending[fd], cap);
+        if (!buf)
+            return -1;
+        pending[fd] = buf;
+        pending_cap[fd] = cap;
+    }
+    memcpy(pending[fd] + pending_len[fd], msg, len);
+    pending_len[fd] += len;
+    if (pending_len[fd] > sendq_high)
+        drop_oldest(fd, sendq_low);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-H high] [-L low] [-p drop|evict] <port>\n", prog);
+    printf("  -H  pending bytes at which a client counts as slow (default %zu)\n", sendq_high);
+    printf("  -L  bytes left pending after dropping old lines (default %zu)\n", sendq_low);
+    printf("  -p  slow client policy: drop oldest lines or evict (default drop)\n");
+    exit(1);
+}
 
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
-        printf("usage: %s <port>\n", argv[0]);
-        exit(1);
+    int opt;
+    while ((opt = getopt(argc, argv, "H:L:p:")) != -1) {
+        switch (opt) {
+        case 'H':
+            sendq_high = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            sendq_low = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0)
+                slow_policy = SLOW_DROP_OLDEST;
+            else if (strcmp(optarg, "evict") == 0)
+                slow_policy = SLOW_EVICT;
+            else
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
+    if (optind >= argc || sendq_low > sendq_high)
+        usage(argv[0]);
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     if (port <= 0) {
-        printf("'%s' not a valid port number\n", argv[1]);
+        printf("'%s' not a valid port number\n", argv[optind]);
         exit(1);
     }
 
@@ -83,9 +205,11 @@ int main(int argc, char **argv)
     int conns[FD_SETSIZE];
     memset(&conns, 0, sizeof(conns));
 
-    /* Create an fd_set to monitor descriptors for readability */
-    fd_set rfds;
+    /* Create an fd_set to monitor descriptors for readability, and one for
+     * clients that still have pending output */
+    fd_set rfds, wfds;
     FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
 
     /* Add the server socket to the set. When it becomes "readable", it
      * indicates an incoming connection */
@@ -101,7 +225,7 @@ int main(int argc, char **argv)
      * Call select() to monitor the set of descriptors. After select() returns,
      * only the descriptors with activity will remain set in rfds.
      */
-    while (select(max_fd, &rfds, NULL, NULL, NULL) >= 0) {
+    while (select(max_fd, &rfds, &wfds, NULL, NULL) >= 0) {
         /* Check if the server socket has become readable, which indicates an
          * incoming connection */
         if (FD_ISSET(server_fd, &rfds)) {
@@ -151,6 +275,15 @@ int main(int argc, char **argv)
             if (!conns[fd])
                 continue;
 
+            /* can we push out some of their pending output? */
+            if (FD_ISSET(fd, &wfds) && flush_pending(fd) < 0) {
+                fprintf(stderr, "write(%d): %s\n", fd, strerror(errno));
+                close(fd);
+                conns[fd] = 0;
+                drop_pending(fd);
+                continue;
+            }
+
             /* is their activity on their fd? */
             if (FD_ISSET(fd, &rfds)) {
                 /* yes! */
@@ -166,6 +299,7 @@ int main(int argc, char **argv)
                     fprintf(stderr, "read(%d): %s\n", fd, strerror(errno));
                     close(fd);
                     conns[fd] = 0;
+                    drop_pending(fd);
                 }
 
                 else if (nread > 0) {
@@ -184,14 +318,16 @@ int main(int argc, char **argv)
                     for (int dest_fd = 0; dest_fd < FD_SETSIZE; dest_fd++) {
                         /* take active connections, but not ourselves */
                         if (conns[dest_fd] && dest_fd != fd) {
-                            /* write to them */
-                            if (write(dest_fd, colored_msg, colored_len) < 0) {
+                            /* write to them, or queue what they can't take yet */
+                            if (send_or_queue(dest_fd, colored_msg, colored_len) < 0) {
                                 /* disconnect if it fails; they might have
-                                 * legitimately gone away without telling us */
+                                 * legitimately gone away without telling us,
+                                 * or stopped reading altogether */
                                 fprintf(stderr, "write(%d): %s\n", dest_fd,
                                         strerror(errno));
                                 close(dest_fd);
                                 conns[dest_fd] = 0;
+                                drop_pending(dest_fd);
                             }
                         }
                     }
@@ -204,6 +340,7 @@ int main(int argc, char **argv)
                     printf("[%d] closed\n", fd);
                     close(fd);
                     conns[fd] = 0;
+                    drop_pending(fd);
                 }
             }
         }
@@ -212,15 +349,19 @@ int main(int argc, char **argv)
          * set again (remember, select() removes descriptors that had no
          * activity) */
         FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
 
         /* add the server */
         FD_SET(server_fd, &rfds);
         max_fd = server_fd + 1;
 
-        /* and all the active connections */
+        /* and all the active connections, watching for writability only
+         * where output is pending */
         for (int fd = 0; fd < FD_SETSIZE; fd++) {
             if (conns[fd]) {
                 FD_SET(fd, &rfds);
+                if (pending_len[fd] > 0)
+                    FD_SET(fd, &wfds);
                 max_fd = fd + 1;
             }
         }
@@ -0,0 +1,610 @@
+/* Load generator and fan-out benchmark for a running chat server.
+ *
+ *   gcc -O2 -pthread -o fanout fanout.c
+ *   ./chat -d - -b epoll 9000 &     # or -b uring
+ *   ./fanout -c 200 -s 4 -m 5000 -P $! 9000
+ *   ./fanout -j 4 -c 2000 -s 20 -r 50 -m 500 9000  # 50 msgs/s per sender
+ *   ./fanout -v 1 -c 200 -s 4 -m 5000 9000         # against chatroom_v0.1
+ *   ./fanout -c 200 -s 4 -r 100 -m 1000 9000 9001  # two linked nodes (-f/-F)
+ *   ./fanout -u chat.sock -T -c 200 -s 4 -m 5000 9000  # with ./chat -u chat.sock
+ *   ./fanout -w -c 200 -s 4 -m 5000 9000           # binary protocol (wire.h)
+ *
+ * Logs in c receivers and s senders, then has every sender broadcast m
+ * messages, either as fast as the server takes them or, with -r, at a fixed
+ * rate. With -v 2 (the default) clients go through the Homemenu flow as
+ * accounts lg0, lg1, ... with password pw, creating each account if it does
+ * not exist yet. With -v 1 there is no login; note that chatroom_v0.1 uses
+ * select() and serves at most FD_SETSIZE clients.
+ *
+ * Every message carries the time it was due to be sent, so receivers can
+ * measure delivery latency. At a fixed rate that is its scheduled time, not
+ * when the write happened, so a server that falls behind is charged for
+ * the whole backlog. Reports deliveries per second, overall and per
+ * recipient, latency percentiles once every receiver has seen every message
+ * (or delivery stalls), and with -P the server's CPU time over the run.
+ * With -j the clients are spread over that many threads, so that the
+ * generator isn't the bottleneck; keep that many cores free for it.
+ *
+ * Given several ports, each of a node of one federation, clients are dealt
+ * out to them in turn, and latency is reported separately for messages
+ * from a sender on the receiver's own node and from one on another node,
+ * whose difference is what the relay costs.
+ *
+ * With -u the receivers connect over the server's Unix socket instead, and
+ * with -T as well each one taps it (/tap) and reads its messages from the
+ * shared-memory ring, sleeping on the eventfd only when it runs dry.
+ *
+ * With -w every client sends /binary after logging in, senders write each
+ * message as a frame of its own, and receivers take its payload for the line.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../tap.h"
+#include "../wire.h"
+
+#define LOGGED_IN "Successfully logged in!\n\n"
+#define BINARY_MODE "Binary mode.\n"
+#define LINE_KEEP 128       // leading bytes of each line kept for parsing
+
+// Log-linear latency histogram: 8 buckets per power of two, within 12.5%.
+#define SUB_BITS 3
+#define BUCKETS (64 << SUB_BITS)
+
+struct client {
+    int fd;
+    int sender;
+    int node;           // index of the port it is connected to
+    int logged_in;
+    size_t matched;     // bytes of LOGGED_IN seen so far
+    long lines;         // this run's messages received after login
+    long sent;          // messages fully written (senders)
+    size_t off;         // bytes of the current message already written
+    int len;            // of the current message
+    char *msg;          // senders: the message being written
+    char line[LINE_KEEP];   // receivers: start of the line being read
+    int line_len;
+    struct tap_ring *ring;  // -T: its tap, the data following at TAP_DATA
+    int efd;
+    int framed;             // -w: past the reply to /binary
+    unsigned char hdr[WIRE_HEADER]; // a frame or message header being read
+    int hdr_len;
+    uint32_t frame_left, payload_left;
+};
+
+struct hist {
+    uint64_t counts[BUCKETS];
+    uint64_t max;
+};
+
+// A thread driving every nworkers-th client.
+struct worker {
+    pthread_t thread;
+    int epfd;
+    int first;
+    long want;          // deliveries to its receivers
+    long got;
+    int senders, senders_done;
+    struct hist hist[2];    // from senders on the same node, and on others
+};
+
+static struct client *clients;
+static int nrecv = 100, nsend = 1, msgs = 10000, msg_len = 64, nworkers = 1;
+static double rate = 0;
+static uint64_t t0;
+static atomic_int senders_done;
+static atomic_uint_fast64_t last_progress;
+static char marker[16];     // "@<tag>:", unique to this run
+static int nports;
+static const char *unix_path;
+static int tapping;
+static int wire;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void hist_record(struct hist *h, uint64_t v)
+{
+    unsigned b = v;
+    if (v >= (1u << SUB_BITS)) {
+        unsigned shift = 63 - __builtin_clzll(v) - SUB_BITS;
+        b = ((shift + 1) << SUB_BITS) + ((v >> shift) & ((1u << SUB_BITS) - 1));
+    }
+    h->counts[b]++;
+    if (v > h->max)
+        h->max = v;
+}
+
+// Upper bound of the bucket holding quantile q.
+static double percentile_us(const struct hist *h, double q)
+{
+    uint64_t total = 0, seen = 0;
+    for (int b = 0; b < BUCKETS; b++)
+        total += h->counts[b];
+    uint64_t rank = q * total;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen > rank) {
+            uint64_t top = b;
+            if (b >= (1 << SUB_BITS)) {
+                unsigned shift = (b >> SUB_BITS) - 1;
+                top = (((1ull << SUB_BITS) + (b & ((1 << SUB_BITS) - 1))) << shift) + (1ull << shift) - 1;
+            }
+            return (top < h->max ? top : h->max) / 1e3;
+        }
+    }
+    return h->max / 1e3;
+}
+
+// utime + stime of pid in seconds, or -1.
+static double cpu_time(int pid)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')');
+    unsigned long ut, st;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st) != 2)
+        return -1;
+    return (double) (ut + st) / sysconf(_SC_CLK_TCK);
+}
+
+static void write_all(int fd, const char *s, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, s, len);
+        if (n < 0) {
+            perror("write");
+            exit(1);
+        }
+        s += n;
+        len -= n;
+    }
+}
+
+/* One whole line arrived: count it and take its latency if it is ours,
+ * into h[0] if it was sent on c's node and h[1] if on another. */
+static void end_line(struct client *c, struct hist *h, uint64_t now)
+{
+    c->line[c->line_len < LINE_KEEP ? c->line_len : LINE_KEEP - 1] = '\0';
+    c->line_len = 0;
+    // Servers wrap the text in color codes, so the stamp isn't at the start.
+    char *p = strstr(c->line, marker);
+    if (!p)
+        return;     // a prompt, or history from an earlier run
+    char *end;
+    int node = strtol(p + strlen(marker), &end, 10);
+    uint64_t due = strtoull(end + 1, NULL, 10);
+    c->lines++;
+    if (!c->sender)
+        hist_record(&h[node != c->node], now > due ? now - due : 0);
+}
+
+// -w: each message's payload stands for a line.
+static void feed_frames(struct client *c, struct hist *h, const unsigned char *buf, size_t n,
+                        uint64_t now)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (c->payload_left) {
+            if (c->line_len < LINE_KEEP - 1)
+                c->line[c->line_len++] = buf[i];
+            if (--c->payload_left == 0)
+                end_line(c, h, now);
+            continue;
+        }
+        c->hdr[c->hdr_len++] = buf[i];
+        if (!c->frame_left && c->hdr_len == 4) {
+            c->frame_left = (uint32_t) c->hdr[0] << 24 | c->hdr[1] << 16 | c->hdr[2] << 8 | c->hdr[3];
+            c->hdr_len = 0;
+        } else if (c->frame_left && c->hdr_len == WIRE_HEADER) {
+            c->payload_left = c->hdr[5] << 8 | c->hdr[6];
+            c->frame_left -= WIRE_HEADER + c->payload_left;
+            c->hdr_len = 0;
+            if (!c->payload_left)
+                end_line(c, h, now);
+        }
+    }
+}
+
+static void feed(struct client *c, struct hist *h, const char *buf, size_t n, uint64_t now)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (!c->logged_in) {
+            c->matched = buf[i] == LOGGED_IN[c->matched] ? c->matched + 1
+                       : buf[i] == LOGGED_IN[0];
+            if (c->matched == sizeof(LOGGED_IN) - 1) {
+                c->logged_in = 1;
+                c->matched = 0;
+            }
+        } else if (c->framed) {
+            feed_frames(c, h, (const unsigned char *) buf + i, n - i, now);
+            return;
+        } else if (wire) {
+            c->matched = buf[i] == BINARY_MODE[c->matched] ? c->matched + 1
+                       : buf[i] == BINARY_MODE[0];
+            c->framed = c->matched == sizeof(BINARY_MODE) - 1;
+        } else if (buf[i] == '\n') {
+            end_line(c, h, now);
+        } else if (c->line_len < LINE_KEEP - 1) {
+            c->line[c->line_len++] = buf[i];
+        }
+    }
+}
+
+// Reads everything available; returns -1 once the server hangs up.
+static int drain(struct client *c, struct hist *h)
+{
+    char buf[65536];
+    for (;;) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n == 0)
+            return -1;
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        feed(c, h, buf, n, now_ns());
+    }
+}
+
+/* Reads a tap's ring dry, then says it is waiting and checks once more,
+ * as tap.h asks before sleeping on the eventfd. */
+static void drain_tap(struct client *c, struct hist *h)
+{
+    struct tap_ring *r = c->ring;
+    const char *data = (const char *) r + TAP_DATA;
+    uint64_t count;
+    (void) !read(c->efd, &count, sizeof(count));
+    for (;;) {
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head == tail) {
+            atomic_store_explicit(&r->waiting, 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load_explicit(&r->tail, memory_order_relaxed) == head)
+                return;
+            atomic_store_explicit(&r->waiting, 0, memory_order_relaxed);
+            continue;
+        }
+        uint64_t now = now_ns();
+        while (head < tail) {
+            size_t at = head & (r->size - 1);
+            size_t n = tail - head < r->size - at ? tail - head : r->size - at;
+            feed(c, h, data + at, n, now);
+            head += n;
+        }
+        atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+}
+
+// Sends /tap and maps the ring that comes back with the reply.
+static int tap(struct client *c)
+{
+    write_all(c->fd, "/tap\n", 5);
+    int off = 0;
+    ioctl(c->fd, FIONBIO, &off);
+    for (;;) {
+        char buf[4096];
+        union {
+            struct cmsghdr h;
+            char buf[CMSG_SPACE(2 * sizeof(int))];
+        } ctl;
+        struct iovec iov = {buf, sizeof(buf)};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf)};
+        if (recvmsg(c->fd, &msg, 0) <= 0)
+            return -1;
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (!cm || cm->cmsg_type != SCM_RIGHTS)
+            continue;   // output from before the reply
+        int fds[2];
+        struct stat st;
+        memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+        if (fstat(fds[0], &st) < 0)
+            return -1;
+        void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        if (p == MAP_FAILED)
+            return -1;
+        close(fds[0]);
+        c->ring = p;
+        c->efd = fds[1];
+        // Asleep from the start, so the first message wakes the worker.
+        atomic_store(&c->ring->waiting, 1);
+        if (atomic_load(&c->ring->tail) != 0) {
+            uint64_t one = 1;
+            (void) !write(c->efd, &one, sizeof(one));
+        }
+        int on = 1;
+        ioctl(c->fd, FIONBIO, &on);
+        return 0;
+    }
+}
+
+/* Stamps the sender's next message with its node and the time it is due;
+ * with -w it goes out as a frame, payload the line less its newline. */
+static void next_message(struct client *c, uint64_t due)
+{
+    int hdr = wire ? 4 + WIRE_HEADER : 0;
+    char *text = c->msg + hdr;
+    int n = snprintf(text, msg_len + 32, "%s%d:%llu:", marker, c->node, (unsigned long long) due);
+    if (n < msg_len - 1) {
+        memset(text + n, 'x', msg_len - 1 - n);
+        n = msg_len - 1;
+    }
+    if (wire) {
+        unsigned char *p = (unsigned char *) c->msg;
+        uint32_t len = WIRE_HEADER + n;
+        unsigned char head[] = {len >> 24, len >> 16, len >> 8, len, WIRE_CHAT, 0, 0, 0, 0, n >> 8, n};
+        memcpy(p, head, sizeof(head));
+    } else {
+        text[n++] = '\n';
+    }
+    c->len = hdr + n;
+    c->off = 0;
+}
+
+/* Writes the sender's messages that are due by now, or with no rate as
+ * many as the socket takes. Returns 1 once all msgs have gone out. */
+static int pump(struct client *c)
+{
+    while (c->sent < msgs) {
+        if (c->off == 0) {
+            uint64_t due = rate ? t0 + (uint64_t) (c->sent * 1e9 / rate) : now_ns();
+            if (rate && due > now_ns())
+                return 0;
+            next_message(c, due);
+        }
+        ssize_t w = write(c->fd, c->msg + c->off, c->len - c->off);
+        if (w < 0)
+            return 0;
+        c->off += w;
+        if (c->off == (size_t) c->len) {
+            c->off = 0;
+            c->sent++;
+        }
+    }
+    return 1;
+}
+
+static void *worker_loop(void *arg)
+{
+    struct worker *w = arg;
+    int total = nrecv + nsend;
+    // As fast as possible, senders write whenever their socket has room;
+    // at a fixed rate they are pumped on a 1 ms tick instead.
+    for (int i = w->first; i < total; i += nworkers) {
+        struct client *c = &clients[i];
+        struct epoll_event ev = {.events = EPOLLIN | (c->sender && !rate ? EPOLLOUT : 0), .data.ptr = c};
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->ring ? c->efd : c->fd, &ev);
+        w->senders += c->sender;
+    }
+
+    struct epoll_event events[256];
+    while (w->got < w->want || w->senders_done < w->senders) {
+        int n = epoll_wait(w->epfd, events, 256, rate && w->senders_done < w->senders ? 1 : 100);
+        if (n == 0 && atomic_load(&senders_done) == nsend &&
+            now_ns() - atomic_load(&last_progress) > 2000000000u)
+            break;  // delivery stalled
+        for (int i = 0; i < n; i++) {
+            struct client *c = events[i].data.ptr;
+            if (events[i].events & EPOLLIN) {
+                long before = c->lines;
+                if (c->ring) {
+                    drain_tap(c, w->hist);
+                } else if (drain(c, w->hist) < 0) {
+                    fprintf(stderr, "server closed a %s\n", c->sender ? "sender" : "receiver");
+                    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                    continue;
+                }
+                if (!c->sender && c->lines != before) {
+                    w->got += c->lines - before;
+                    atomic_store(&last_progress, now_ns());
+                }
+            }
+            if ((events[i].events & EPOLLOUT) && c->sent < msgs && pump(c)) {
+                struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+                epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                w->senders_done++;
+                atomic_fetch_add(&senders_done, 1);
+            }
+        }
+        for (int i = w->first + nrecv / nworkers * nworkers; rate && i < total; i += nworkers) {
+            struct client *c = &clients[i];
+            if (c->sender && c->sent < msgs && pump(c)) {
+                w->senders_done++;
+                atomic_fetch_add(&senders_done, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int server_pid = 0, version = 2, opt;
+    while ((opt = getopt(argc, argv, "c:j:l:m:P:r:s:Tu:v:w")) != -1) {
+        switch (opt) {
+        case 'c': nrecv = atoi(optarg); break;
+        case 'j': nworkers = atoi(optarg); break;
+        case 'l': msg_len = atoi(optarg); break;
+        case 'm': msgs = atoi(optarg); break;
+        case 'P': server_pid = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 's': nsend = atoi(optarg); break;
+        case 'T': tapping = 1; break;
+        case 'u': unix_path = optarg; break;
+        case 'v': version = atoi(optarg); break;
+        case 'w': wire = 1; break;
+        default: goto usage;
+        }
+    }
+    nports = argc - optind;
+    if (nports < 1 || nrecv < 1 || nsend < 1 || msgs < 1 || msg_len < 2 ||
+        nworkers < 1 || rate < 0 || (version != 1 && version != 2) || (tapping && !unix_path) ||
+        (tapping && version != 2) || (wire && (version != 2 || tapping || msg_len > WIRE_PAYLOAD_MAX))) {
+usage:
+        printf("usage: %s [-c receivers] [-s senders] [-m messages] [-l length] [-r rate] [-j threads] [-u path [-T]] [-w] [-v 1|2] [-P server pid] <port>...\n", argv[0]);
+        printf("  -r  messages per second per sender, 0 for as fast as possible (default 0)\n");
+        printf("  -j  client threads (default 1)\n");
+        printf("  -u  connect receivers to the server's Unix socket at path; -T to tap it too\n");
+        printf("  -w  speak the binary protocol (/binary) rather than lines\n");
+        printf("  -v  server protocol: 1 for chatroom_v0.1, 2 for the Homemenu login (default 2)\n");
+        printf("  several ports are linked nodes; clients are spread over them\n");
+        return 1;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    int total = nrecv + nsend;
+    clients = calloc(total, sizeof(*clients));
+    int epfd = epoll_create1(0);
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    if (unix_path)
+        snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", unix_path);
+    snprintf(marker, sizeof(marker), "@%x:", (unsigned) getpid());
+
+    for (int i = 0; i < total; i++) {
+        struct client *c = &clients[i];
+        c->sender = i >= nrecv;
+        c->node = i % nports;
+        addr.sin_port = htons(atoi(argv[optind + c->node]));
+        bool local = unix_path && !c->sender;
+        c->fd = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+        if (c->fd < 0 || (local ? connect(c->fd, (struct sockaddr *) &sun, sizeof(sun))
+                                : connect(c->fd, (struct sockaddr *) &addr, sizeof(addr))) < 0) {
+            perror("connect");
+            return 1;
+        }
+        if (version == 2) {
+            // Create the account (which fails harmlessly if it exists), then log in.
+            char script[128];
+            int n = snprintf(script, sizeof(script), "2\nlg%d\ny\npw\n1\nlg%d\npw\n%s", i, i,
+                             wire ? "/binary\n" : "");
+            write_all(c->fd, script, n);
+        } else {
+            c->logged_in = 1;
+        }
+        if (c->sender)
+            c->msg = malloc(msg_len + 32 + 4 + WIRE_HEADER);
+        int on = 1;
+        ioctl(c->fd, FIONBIO, &on);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    struct epoll_event events[256];
+    static struct hist login_hist[2];   // nothing of ours arrives yet
+    for (int joined = version == 2 ? 0 : total; joined < total;) {
+        int n = epoll_wait(epfd, events, 256, 5000);
+        if (n == 0) {
+            fprintf(stderr, "only %d of %d clients logged in\n", joined, total);
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            struct client *c = events[i].data.ptr;
+            int was = c->logged_in && c->framed == wire;
+            if (drain(c, login_hist) < 0) {
+                fprintf(stderr, "login failed\n");
+                return 1;
+            }
+            joined += (c->logged_in && c->framed == wire) - was;
+        }
+    }
+    close(epfd);
+    for (int i = 0; tapping && i < nrecv; i++) {
+        if (tap(&clients[i]) < 0) {
+            fprintf(stderr, "/tap failed\n");
+            return 1;
+        }
+    }
+    if (version == 1)
+        usleep(500000);     // nothing confirms a connection; let the server accept them all
+    printf("%d receivers, %d senders logged in; sending %d x %d bytes each", nrecv, nsend, msgs, msg_len);
+    if (rate)
+        printf(" at %g/s", rate);
+    printf("\n");
+    fflush(stdout);
+
+    // Client i belongs to worker i % nworkers.
+    struct worker *workers = calloc(nworkers, sizeof(*workers));
+    double cpu0 = server_pid ? cpu_time(server_pid) : -1;
+    t0 = now_ns();
+    atomic_store(&last_progress, t0);
+    for (int j = 0; j < nworkers; j++) {
+        struct worker *w = &workers[j];
+        w->first = j;
+        w->epfd = epoll_create1(0);
+        w->want = (long) ((nrecv - j + nworkers - 1) / nworkers) * nsend * msgs;
+        if (pthread_create(&w->thread, NULL, worker_loop, w) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    long want = (long) nrecv * nsend * msgs;
+    long got = 0;
+    static struct hist hist[2];
+    for (int j = 0; j < nworkers; j++) {
+        struct worker *w = &workers[j];
+        pthread_join(w->thread, NULL);
+        got += w->got;
+        for (int k = 0; k < 2; k++) {
+            for (int b = 0; b < BUCKETS; b++)
+                hist[k].counts[b] += w->hist[k].counts[b];
+            if (w->hist[k].max > hist[k].max)
+                hist[k].max = w->hist[k].max;
+        }
+    }
+    if (got < want)
+        fprintf(stderr, "delivery stalled\n");
+    double elapsed = (atomic_load(&last_progress) - t0) / 1e9;
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+
+    long slowest = -1;
+    for (int i = 0; i < nrecv; i++)
+        if (slowest < 0 || clients[i].lines < slowest)
+            slowest = clients[i].lines;
+    printf("delivered %ld of %ld in %.3f s: %.0f msgs/s, %.0f msgs/s per recipient (slowest %.0f)\n",
+           got, want, elapsed, got / elapsed, got / elapsed / nrecv, slowest / elapsed);
+    for (int k = 0; k < (nports > 1 ? 2 : 1); k++) {
+        const struct hist *h = &hist[k];
+        printf("%slatency us: p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+               nports == 1 ? "" : k == 0 ? "same-node " : "cross-node ",
+               percentile_us(h, 0.5), percentile_us(h, 0.99), percentile_us(h, 0.999), h->max / 1e3);
+    }
+    if (cpu0 >= 0)
+        printf("server cpu %.2f s (%.2f us per delivery)\n",
+               cpu_time(server_pid) - cpu0, (cpu_time(server_pid) - cpu0) * 1e6 / (got ? got : 1));
+    return 0;
+}
@@ -0,0 +1,146 @@
+/* Account store benchmark: the original layout (two malloc'd strings per
+ * slot behind two char** arrays) against userdb.c's paged records.
+ *
+ *   gcc -O2 -pthread -I.. -o userdb_bench userdb_bench.c ../userdb.c
+ *   ./userdb_bench [accounts]
+ *
+ * Reports heap bytes per account, time to create every account, time for a
+ * full scan over all usernames, and time for random lookups by name.
+ */
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "userdb.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t heap_used(void)
+{
+    return mallinfo2().uordblks + mallinfo2().hblkhd;
+}
+
+// The pre-arena store, kept here only as a baseline.
+static char **legacy_user, **legacy_pswd;
+static int legacy_size, legacy_max = 10;
+
+static void legacy_init(void)
+{
+    legacy_user = malloc(sizeof(char *) * legacy_max);
+    legacy_pswd = malloc(sizeof(char *) * legacy_max);
+    for (int i = 0; i < legacy_max; i++) {
+        legacy_user[i] = malloc(MAX_USERNAME_LENGTH);
+        legacy_pswd[i] = malloc(MAX_PASSWORD_LENGTH);
+    }
+}
+
+static void legacy_create(const char *username, const char *password)
+{
+    if (legacy_size >= legacy_max) {
+        int new_size = legacy_max * 2;
+        legacy_user = realloc(legacy_user, sizeof(char *) * new_size);
+        legacy_pswd = realloc(legacy_pswd, sizeof(char *) * new_size);
+        for (int i = legacy_max; i < new_size; i++) {
+            legacy_user[i] = malloc(MAX_USERNAME_LENGTH);
+            legacy_pswd[i] = malloc(MAX_PASSWORD_LENGTH);
+        }
+        legacy_max = new_size;
+    }
+    strcpy(legacy_user[legacy_size], username);
+    strcpy(legacy_pswd[legacy_size], password);
+    legacy_size++;
+}
+
+// Results are summed into here so no loop can be optimized away.
+static volatile size_t sink;
+
+static size_t scan(char *(*name)(int), int n)
+{
+    size_t total = 0;
+    for (int i = 0; i < n; i++)
+        total += strlen(name(i));
+    return total;
+}
+
+static char *legacy_name(int i)
+{
+    return legacy_user[i];
+}
+
+static int legacy_find(const char *username)
+{
+    for (int i = 0; i < legacy_size; i++) {
+        if (strcmp(legacy_user[i], username) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    int lookups = 200;
+    char name[32];
+    double t;
+
+    size_t base = heap_used();
+    t = now();
+    legacy_init();
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        legacy_create(name, "secret");
+    }
+    double legacy_create_s = now() - t;
+    size_t legacy_bytes = heap_used() - base;
+
+    base = heap_used();
+    t = now();
+    init_db(NULL);
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        create_account(name, "secret");
+    }
+    double arena_create_s = now() - t;
+    size_t arena_bytes = heap_used() - base;
+
+    t = now();
+    sink += scan(legacy_name, n);
+    double legacy_scan_s = now() - t;
+    t = now();
+    sink += scan(find_username, n);
+    double arena_scan_s = now() - t;
+
+    srand(1);
+    t = now();
+    for (int i = 0; i < lookups; i++) {
+        snprintf(name, sizeof(name), "user%d", rand() % n);
+        sink += legacy_find(name);
+    }
+    double legacy_find_s = (now() - t) / lookups;
+    t = now();
+    for (int i = 0; i < lookups; i++) {
+        snprintf(name, sizeof(name), "user%d", rand() % n);
+        sink += find_account(name);
+    }
+    double arena_find_s = (now() - t) / lookups;
+
+    printf("%d accounts\n", n);
+    printf("%-8s %12s %12s %12s %12s\n", "layout", "bytes/acct", "create ms",
+           "scan ms", "lookup us");
+    printf("%-8s %12.1f %12.1f %12.2f %12.3f\n", "legacy",
+           (double) legacy_bytes / n, legacy_create_s * 1e3,
+           legacy_scan_s * 1e3, legacy_find_s * 1e6);
+    printf("%-8s %12.1f %12.1f %12.2f %12.3f\n", "arena",
+           (double) arena_bytes / n, arena_create_s * 1e3,
+           arena_scan_s * 1e3, arena_find_s * 1e6);
+    printf("(arena bytes include the hash index)\n");
+    return 0;
+}
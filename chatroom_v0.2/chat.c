@@ -1,48 +1,1775 @@
-/* chat server using select(2) with client–side UI for login and menus */
+/* chat server using edge-triggered epoll(7) with client–side UI for login and menus.
+ * Login and registration run as a per-connection state machine (login.c), so
+ * nothing in the loop ever blocks on a single client.
+ *
+ * With -t N the server runs N shards, each a thread with its own
+ * SO_REUSEPORT listener and epoll loop. The kernel spreads new connections
+ * across the listeners, and each connection stays on the shard that accepted
+ * it. Each connection is a struct conn from its shard's pool (pool.h),
+ * found by fd through a table all shards share, and is only ever touched
+ * by its own shard.
+ *
+ * Every logged-in connection is in exactly one room, starting in the lobby.
+ * A message goes to the room's members on the sender's shard directly, and
+ * through their mailboxes to just the other shards the room has members on.
+ *
+ * -b uring swaps each shard's epoll loop for io_uring: multishot accept,
+ * multishot recv into a ring of provided buffers, and one sendmsg SQE per
+ * connection with pending output, all submitted in one batch per loop
+ * iteration. If the kernel can't do that, the server falls back to epoll.
+ *
+ * Each shard counts what its loop does (metrics.h); /stats reports the
+ * totals and the asking connection's own counters.
+ *
+ * Every connection has one timer on its shard's timer wheel (timer.h): the
+ * login deadline until it logs in, then the sooner of its idle kick and its
+ * next keepalive. Input only records when it arrived; the timer checks that
+ * when it fires and re-arms itself for whatever is due next, so a busy
+ * connection never touches the wheel. The loop sleeps until the wheel's
+ * next tick with work.
+ *
+ * With -M or -B, input is metered by per-connection token buckets. A
+ * client that runs out is not read from until they refill: its unread
+ * lines wait in its linebuf and then in the socket, and TCP pushes back on
+ * the sender. A flood thus costs the server no more broadcasts than the
+ * rate allows, and nothing is dropped.
+ *
+ * SIGUSR2 upgrades the server in place: every shard stops at the end of
+ * its loop iteration, and the server runs a new copy of its binary and
+ * hands it the listeners and every connection over a Unix socket
+ * (upgrade.h), with each connection's state (login progress, account,
+ * room, unhandled input, unsent output, timers) in a memfd alongside.
+ * Clients see a pause, not a disconnect. If the new process fails to take
+ * over, this one goes on serving.
+ *
+ * With -u the server also listens on a Unix socket, for bots on the same
+ * host. They speak the same protocol, and one can send /tap to have its
+ * output written to a shared-memory ring (tap.h) rather than its socket.
+ *
+ * A logged-in client can send /binary to switch both directions to
+ * length-prefixed frames (wire.h): bare text with a type and sender id
+ * instead of color codes. Each message is framed once for all binary
+ * recipients, as it is formatted once for the rest.
+ *
+ * With -f and -F the server is one node of several (relay.h): messages
+ * said here also go once to each linked node, whose rooms of the same name
+ * get them, and /online counts everyone logged in on any node. */
 
+#define _GNU_SOURCE     // memfd_create
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "chatlog.h"
+#include "linebuf.h"
+#include "log.h"
 #include "login.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "pool.h"
+#include "presence.h"
+#include "relay.h"
+#include "rooms.h"
+#include "sendq.h"
+#include "tap.h"
+#include "timer.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "wire.h"
 
-int client_colors[FD_SETSIZE] = {0};
-int fd_to_index[FD_SETSIZE] = {0};
-// Stack to keep track online fd-s
-int online_fd[FD_SETSIZE] = {0};
-int user_count = 0;
+/* Descriptors served, at most. The table that finds a connection by its
+ * descriptor is allocated FD_CHUNK entries at a time as descriptors come
+ * into use, and chunks never move, so any shard can look one up. Each
+ * entry carries its shard's id in the pointer's low bits, which pool
+ * alignment leaves clear, so a shard can tell its own connections from
+ * others' without touching memory the owner may be giving back. */
+#define MAX_FDS (1 << 20)
+#define FD_CHUNK 4096
+#define MAX_EVENTS 256
+#define MAX_SHARDS ROOM_MAX_SHARDS
+#define CONN_SLAB 256       // connections per pool slab
 
+// c->state says what the connection is doing.
+enum {
+    CONN_NONE = 0,
+    CONN_LOGIN,     // still in the Homemenu / login / create flow
+    CONN_CHAT,      // logged in and in a room
+};
 
-int main(int argc, char **argv)
+/* Input allowance per connection, in thousandths of a message and of a
+ * byte so that it refills smoothly by the millisecond. Each line is charged
+ * after it is handled, so a client overdraws by at most one line, and is
+ * then paused until the debt is paid off. */
+struct bucket {
+    int64_t msgs, bytes;
+    uint64_t at;    // ms of the last refill
+};
+
+/* One connection, all of it in one place. What every event and delivery
+ * looks at comes first, so a broadcast touches a cache line or two per
+ * recipient; then input, metering, and what only some commands use. */
+struct conn {
+    int fd;
+    int state;
+    unsigned gen;           // unique in its shard; tags io_uring requests
+    unsigned char shard;    // the shard that owns it
+    char binary;            // framed (wire.h) since /binary
+    char throttled;         // reads paused until resume_timer fires
+    char recv_paused;       // BACKEND_URING; see uring_recv_done()
+    char is_dirty;
+    int dirty_pos;          // slot in the shard's dirty[]
+    int account, color;     // CONN_CHAT
+    struct room_ref room;
+    int room_pos;           // slot in the room's local members[]
+    struct tap *tap;        // output goes here instead of the socket
+    struct uring_send *send_busy;   // the io_uring send in flight
+    struct sendq sendq;
+
+    struct linebuf in;
+    uint32_t frame_left;    // binary: input frame not yet parsed
+    uint64_t heard_at;      // ms of the last input
+    struct bucket bucket;
+    uint64_t lines_in;      // for /stats; output is counted by sendq
+    uint64_t bytes_in;
+    struct timer timer;
+    struct timer resume_timer;
+
+    int reply_to;           // account of the last direct message, or -1
+    int replay_pos;         // slot in the shard's replaying[]
+    struct chatlog_cursor *replay;  // a /log replay in progress
+    struct login_session session;
+};
+
+static _Atomic(_Atomic uintptr_t *) fd_table[MAX_FDS / FD_CHUNK];
+_Static_assert(MAX_SHARDS <= POOL_ALIGN, "shard ids must fit a pool pointer's low bits");
+
+enum { BACKEND_EPOLL, BACKEND_URING };
+static int backend = BACKEND_EPOLL;
+
+struct room_local {
+    unsigned gen;   // of the room these are in; stale once count is 0
+    struct conn **members;
+    int count, cap;
+};
+
+struct shard {
+    int id;
+    pthread_t thread;
+    int epfd;               // BACKEND_EPOLL
+    struct uring ring;      // BACKEND_URING
+    int listen_fd;
+    int unix_fd;            // shard 0: the Unix socket's listener, or -1
+    struct mailbox mailbox;
+
+    /* Each room's members on this shard, indexed by room slot. Every
+     * logged-in connection is in one of them and in the global presence registry;
+     * half-finished logins are in neither. */
+    struct room_local *rooms;
+
+    /* Connections with freshly queued output. Nothing is written while
+     * events are being handled; flush_dirty() then sends each of these once
+     * with one gathered write, however many messages piled up meanwhile. */
+    struct conn **dirty;
+    int dirty_count;
+
+    /* Connections replaying the chat log. Each gets another chunk whenever
+     * its queue runs below sendq_low, so a long replay shares the loop with
+     * live traffic instead of holding it up. */
+    struct conn **replaying;
+    int replay_count;
+
+    // Its connections. dirty and replaying have room for all of them.
+    struct pool conns;
+    unsigned conn_cap;
+    unsigned conn_gen;      // the last connection's gen
+
+    struct stats stats;
+    uint64_t loop_start;    // when this iteration's events came in
+
+    struct timer_wheel timers;
+    struct __kernel_timespec timeout;   // BACKEND_URING: of the timeout SQE
+    uint64_t timeout_at;                // ms it fires, or 0 if none is armed
+
+    int accepting;          // BACKEND_URING: multishot accepts armed
+    bool stopped;           // BACKEND_URING: by uring_stop() for an upgrade
+};
+
+static struct shard *shards;
+static int nshards = 1;
+static __thread struct shard *self;     // the shard this thread runs
+
+/* What to do with a client whose send queue passes sendq_high bytes:
+ * drop its oldest queued messages down to sendq_low, or disconnect it. */
+enum { SLOW_DROP_OLDEST, SLOW_EVICT };
+static size_t sendq_high = 256 * 1024;
+static size_t sendq_low = 64 * 1024;
+static int slow_policy = SLOW_DROP_OLDEST;
+
+// Bytes of the chat log queued per connection at a time during /log.
+#define REPLAY_CHUNK (64 * 1024)
+
+/* Seconds a client gets to log in, of silence after which it is
+ * disconnected, and of silence after which it is sent a keepalive (which
+ * lets TCP notice a dead peer); 0 turns each off. */
+static unsigned login_timeout = 60;
+static unsigned idle_timeout = 0;
+static unsigned ping_interval = 0;
+// Moves the cursor nowhere, so a terminal shows nothing.
+#define KEEPALIVE "\033[0m"
+
+// Sustained rates per second and bursts; a rate of 0 is unlimited.
+static unsigned msg_rate, msg_burst, byte_rate, byte_burst;
+
+// Set by SIGUSR2; every shard loop returns at the end of its iteration.
+static atomic_bool upgrade_asked;
+static uint64_t upgrade_at;         // ns the signal came in
+static char **server_argv;          // as given, for starting the new process
+
+// Account database, or NULL to keep accounts in memory only.
+static const char *db_file = "accounts.db";
+
+// Bytes of recent messages kept per room, in all rooms together, and how
+// many are replayed on join.
+static size_t history_size = 16 * 1024;
+static size_t history_budget = 64 << 20;
+#define HISTORY_REPLAY 20
+
+// Makes space for one more local member of the room in slot.
+static int room_reserve(int slot)
 {
-    init_db();
+    struct room_local *r = &self->rooms[slot];
+    if (r->count < r->cap)
+        return 0;
+    int cap = r->cap ? r->cap * 2 : 8;
+    struct conn **members = realloc(r->members, sizeof(*members) * cap);
+    if (!members)
+        return -1;
+    r->members = members;
+    r->cap = cap;
+    return 0;
+}
 
-    if (argc < 2) {
-        printf("usage: %s <port>\n", argv[0]);
-        exit(1);
+// Puts c into a room it has already been counted in by room_join(), with
+// space reserved.
+static void room_enter(struct conn *c, struct room_ref ref)
+{
+    struct room_local *r = &self->rooms[ref.slot];
+    if (r->count == 0) {
+        r->gen = ref.gen;
+        room_shard_set(ref.slot, self->id, true);
     }
-    int port = atoi(argv[1]);
-    if (port <= 0) {
-        printf("'%s' not a valid port number\n", argv[1]);
+    c->room_pos = r->count;
+    r->members[r->count++] = c;
+    c->room = ref;
+}
+
+static void room_exit(struct conn *c)
+{
+    struct room_ref ref = c->room;
+    struct room_local *r = &self->rooms[ref.slot];
+    struct conn *last = r->members[--r->count];
+    r->members[c->room_pos] = last;
+    last->room_pos = c->room_pos;
+    if (r->count == 0)
+        room_shard_set(ref.slot, self->id, false);
+    room_leave(ref);
+}
+
+// Logs c in as user_index, into the room called name.
+static int conn_add(struct conn *c, int user_index, const char *name)
+{
+    struct room_ref room;
+    if (room_join(name, &room) < 0)
+        return -1;
+    if (room_reserve(room.slot) < 0) {
+        room_leave(room);
+        return -1;
+    }
+    if (presence_add(c->fd, user_index, self->id) < 0) {
+        room_leave(room);
+        return -1;
+    }
+    room_enter(c, room);
+    c->state = CONN_CHAT;
+    c->account = user_index;
+    c->reply_to = -1;
+    relay_presence(user_index);
+    return 0;
+}
+
+static void replay_stop(struct conn *c)
+{
+    chatlog_cursor_close(c->replay);
+    free(c->replay);
+    c->replay = NULL;
+    struct conn *last = self->replaying[--self->replay_count];
+    self->replaying[c->replay_pos] = last;
+    last->replay_pos = c->replay_pos;
+}
+
+// Monotonic time of this loop iteration, in ms.
+static uint64_t loop_ms(void)
+{
+    return self->loop_start / 1000000;
+}
+
+// This shard's connection at fd, or NULL.
+static struct conn *conn_at(int fd)
+{
+    _Atomic uintptr_t *chunk = atomic_load_explicit(&fd_table[fd / FD_CHUNK], memory_order_acquire);
+    uintptr_t e = chunk ? atomic_load_explicit(&chunk[fd % FD_CHUNK], memory_order_relaxed) : 0;
+    return e && (e & (POOL_ALIGN - 1)) == (uintptr_t) self->id ? (struct conn *) (e - self->id) : NULL;
+}
+
+/* This shard's connection at *fd or the next one up, moving *fd to it, or
+ * NULL past the last. Chunks never used are skipped whole. */
+static struct conn *conn_scan(int *fd)
+{
+    for (; *fd < MAX_FDS; ++*fd) {
+        if (!atomic_load_explicit(&fd_table[*fd / FD_CHUNK], memory_order_acquire)) {
+            *fd |= FD_CHUNK - 1;
+            continue;
+        }
+        struct conn *c = conn_at(*fd);
+        if (c)
+            return c;
+    }
+    return NULL;
+}
+
+// Points fd's entry at c, or clears it; the first fd of a chunk adds it.
+static int fd_table_set(int fd, struct conn *c)
+{
+    _Atomic uintptr_t *chunk = atomic_load_explicit(&fd_table[fd / FD_CHUNK], memory_order_acquire);
+    if (!chunk) {
+        _Atomic uintptr_t *fresh = calloc(FD_CHUNK, sizeof(*fresh));
+        if (!fresh)
+            return -1;
+        // Another shard may have added it meanwhile; theirs stands.
+        if (atomic_compare_exchange_strong_explicit(&fd_table[fd / FD_CHUNK], &chunk, fresh,
+                                                    memory_order_acq_rel, memory_order_acquire))
+            chunk = fresh;
+        else
+            free(fresh);
+    }
+    atomic_store_explicit(&chunk[fd % FD_CHUNK], c ? (uintptr_t) c | self->id : 0,
+                          memory_order_relaxed);
+    return 0;
+}
+
+// Makes room in the shard's per-connection lists for one more.
+static int shard_reserve(void)
+{
+    if (self->conns.live < self->conn_cap)
+        return 0;
+    unsigned cap = self->conn_cap ? self->conn_cap * 2 : 64;
+    struct conn **dirty = realloc(self->dirty, sizeof(*dirty) * cap);
+    if (!dirty)
+        return -1;
+    self->dirty = dirty;
+    struct conn **replaying = realloc(self->replaying, sizeof(*replaying) * cap);
+    if (!replaying)
+        return -1;
+    self->replaying = replaying;
+    self->conn_cap = cap;
+    return 0;
+}
+
+static void conn_timeout(struct timer *t);
+static void conn_resume(struct timer *t);
+
+/* A connection for fd from the shard's pool, in CONN_LOGIN, or NULL if out
+ * of memory. */
+static struct conn *conn_new(int fd)
+{
+    struct conn *c;
+    if (fd >= MAX_FDS) {
+        log_warn("[%d] fd exceeds MAX_FDS, dropping", fd);
+        return NULL;
+    }
+    if (shard_reserve() < 0 || !(c = pool_get(&self->conns)))
+        goto oom;
+    if (fd_table_set(fd, c) < 0) {
+        pool_put(&self->conns, c);
+        goto oom;
+    }
+    c->fd = fd;
+    c->state = CONN_LOGIN;
+    c->gen = ++self->conn_gen;
+    c->shard = self->id;
+    c->reply_to = -1;
+    c->timer.fire = conn_timeout;
+    c->resume_timer.fire = conn_resume;
+    STAT_ADD(accepts, 1);
+    return c;
+oom:
+    log_error("[%d] out of memory for a connection", fd);
+    return NULL;
+}
+
+static void conn_close(struct conn *c)
+{
+    int fd = c->fd;
+    timer_cancel(&self->timers, &c->timer);
+    timer_cancel(&self->timers, &c->resume_timer);
+    c->throttled = 0;
+    c->recv_paused = 0;
+    if (c->state == CONN_CHAT) {
+        room_exit(c);
+        presence_remove(fd);
+        relay_presence(c->account);
+    }
+    if (c->replay)
+        replay_stop(c);
+    if (c->is_dirty) {
+        struct conn *last = self->dirty[--self->dirty_count];
+        self->dirty[c->dirty_pos] = last;
+        last->dirty_pos = c->dirty_pos;
+        c->is_dirty = 0;
+    }
+    STAT_ADD(closes, 1);
+    linebuf_free(&c->in);
+    sendq_clear(&c->sendq);
+    if (c->tap) {
+        tap_close(c->tap);
+        free(c->tap);
+        c->tap = NULL;
+    }
+    /* Back to the pool, but left as it is until the loop iteration ends, so
+     * a caller still holding c sees CONN_NONE. The fd may be reused by another
+     * shard as soon as it is closed, so its entry is cleared first. */
+    c->state = CONN_NONE;
+    c->send_busy = NULL;
+    fd_table_set(fd, NULL);
+    pool_put(&self->conns, c);
+    // In-flight io_uring requests keep the socket open past close(); the
+    // shutdown ends them, and they find the fd gone or another's.
+    if (backend == BACKEND_URING)
+        shutdown(fd, SHUT_RDWR);
+    close(fd);  // also drops fd from the epoll set
+}
+
+static void mark_dirty(struct conn *c)
+{
+    if (!c->is_dirty) {
+        c->is_dirty = 1;
+        c->dirty_pos = self->dirty_count;
+        self->dirty[self->dirty_count++] = c;
+    }
+}
+
+/* Copies m into c's tap. A full ring loses the message, or with
+ * SLOW_EVICT the client; the counts go in c's queue as if it were sent. */
+static int conn_tap_push(struct conn *c, struct msgbuf *m)
+{
+    struct sendq *q = &c->sendq;
+    STAT_ADD(msgs_out, 1);
+    if (tap_write(c->tap, m->data, m->len)) {
+        q->pushed++;
+        q->sent += m->len;
+        STAT_ADD(bytes_out, m->len);
+        atomic_store_explicit(&m->delivered, true, memory_order_relaxed);
+    } else if (slow_policy == SLOW_EVICT) {
+        log_info("[%d] evicted: tap full", c->fd);
+        STAT_ADD(evicted, 1);
+        conn_close(c);
+        return -1;
+    } else {
+        q->dropped++;
+        STAT_ADD(dropped, 1);
+    }
+    mark_dirty(c);      // for tap_wake()
+    return 0;
+}
+
+// Queues a reference to m for c. Returns -1 if the connection had to be
+// closed.
+static int conn_push(struct conn *c, struct msgbuf *m)
+{
+    struct sendq *q = &c->sendq;
+    if (!c->state)
+        return -1;
+    if (c->binary && !(m = wire_frame(m))) {
+        log_error("[%d] out of memory framing output", c->fd);
+        conn_close(c);
+        return -1;
+    }
+    if (c->tap)
+        return conn_tap_push(c, m);
+    if (sendq_push(q, m) < 0) {
+        log_error("[%d] out of memory queueing output", c->fd);
+        conn_close(c);
+        return -1;
+    }
+    STAT_ADD(msgs_out, 1);
+    if (q->bytes > sendq_high && !c->send_busy) {
+        // Only a socket that really can't keep up counts as slow.
+        if (sendq_flush(q, c->fd) < 0) {
+            log_warn("write(%d): %s", c->fd, strerror(errno));
+            conn_close(c);
+            return -1;
+        }
+    }
+    if (q->bytes > sendq_high) {
+        if (slow_policy == SLOW_EVICT) {
+            log_info("[%d] evicted: %zu bytes queued", c->fd, q->bytes);
+            STAT_ADD(evicted, 1);
+            conn_close(c);
+            return -1;
+        }
+        size_t dropped = q->dropped;
+        sendq_drop_oldest(q, sendq_low);
+        STAT_ADD(dropped, q->dropped - dropped);
+    }
+    mark_dirty(c);
+    return 0;
+}
+
+static int conn_send(struct conn *c, const char *data, size_t len)
+{
+    struct msgbuf *m = msgbuf_from(data, len);
+    if (!m)
+        return -1;
+    int ret = conn_push(c, m);
+    msgbuf_put(m);
+    return ret;
+}
+
+// Writes out c's queue, on EPOLLOUT or at the end of a loop iteration.
+static void conn_flush(struct conn *c)
+{
+    if (sendq_flush(&c->sendq, c->fd) < 0) {
+        log_warn("write(%d): %s", c->fd, strerror(errno));
+        conn_close(c);
+    }
+}
+
+static void uring_start_send(struct conn *c);
+
+// Output queued for c and not yet taken, in its socket's queue or its tap.
+static size_t conn_queued(struct conn *c)
+{
+    return c->tap ? tap_queued(c->tap) : c->sendq.bytes;
+}
+
+// Tops up every replay whose queue has run low with the next chunk.
+static void refill_replays(void)
+{
+    for (int i = 0; i < self->replay_count; i++) {
+        struct conn *c = self->replaying[i];
+        if (conn_queued(c) >= sendq_low)
+            continue;
+        struct msgbuf *m = chatlog_next(c->replay, REPLAY_CHUNK);
+        if (!m) {
+            replay_stop(c);
+            i--;  // the last replay moved into slot i
+            continue;
+        }
+        if (conn_push(c, m) < 0)
+            i--;  // conn_close() stopped it
+        msgbuf_put(m);
+    }
+}
+
+// Whether a replay could take another chunk right now.
+static bool replay_hungry(void)
+{
+    for (int i = 0; i < self->replay_count; i++)
+        if (conn_queued(self->replaying[i]) < sendq_low)
+            return true;
+    return false;
+}
+
+static void flush_dirty(void)
+{
+    refill_replays();
+    while (self->dirty_count > 0) {
+        struct conn *c = self->dirty[--self->dirty_count];
+        c->is_dirty = 0;
+        STAT_RECORD(queue_bytes, conn_queued(c));
+        if (c->tap)
+            tap_wake(c->tap);
+        else if (backend == BACKEND_URING)
+            uring_start_send(c);
+        else
+            conn_flush(c);
+    }
+}
+
+void client_send(int client_fd, const char *msg)
+{
+    struct conn *c = conn_at(client_fd);
+    if (c)
+        conn_send(c, msg, strlen(msg));
+}
+
+// Says why, with a best-effort write, and disconnects c.
+static void conn_kick(struct conn *c, const char *why)
+{
+    client_send(c->fd, why);
+    if (c->state && !c->send_busy)
+        sendq_flush(&c->sendq, c->fd);
+    conn_close(c);
+}
+
+// A keepalive: one that renders as nothing, or WIRE_PING.
+static int conn_ping(struct conn *c)
+{
+    struct msgbuf *m = msgbuf_from(KEEPALIVE, sizeof(KEEPALIVE) - 1);
+    if (!m)
+        return -1;
+    m->kind = WIRE_PING;
+    int ret = conn_push(c, m);
+    msgbuf_put(m);
+    return ret;
+}
+
+/* Arms a logged-in connection's timer for its next idle kick or keepalive, or
+ * handles the one that is due. */
+static void conn_schedule(struct conn *c)
+{
+    uint64_t now = loop_ms();
+    uint64_t next = UINT64_MAX;
+    if (idle_timeout) {
+        next = c->heard_at + idle_timeout * 1000ull;
+        if (now >= next) {
+            log_info("[%d] idle for %us, disconnecting", c->fd, idle_timeout);
+            conn_kick(c, "Disconnected for being idle.\n");
+            return;
+        }
+    }
+    if (ping_interval) {
+        uint64_t ping = c->heard_at + ping_interval * 1000ull;
+        if (now >= ping) {
+            if (conn_ping(c) < 0)
+                return;
+            ping = now + ping_interval * 1000ull;
+        }
+        if (ping < next)
+            next = ping;
+    }
+    if (next != UINT64_MAX)
+        timer_arm(&self->timers, &c->timer, next);
+}
+
+static void conn_timeout(struct timer *t)
+{
+    struct conn *c = (struct conn *) ((char *) t - offsetof(struct conn, timer));
+    if (c->state == CONN_LOGIN) {
+        log_info("[%d] login timed out", c->fd);
+        conn_kick(c, "\nLogin timed out.\n");
+    } else if (c->state == CONN_CHAT) {
+        conn_schedule(c);
+    }
+}
+
+// Lift the descriptor limit as far as the hard limit allows.
+static void raise_nofile(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return;
+    rl.rlim_cur = rl.rlim_max < MAX_FDS ? rl.rlim_max : MAX_FDS;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        perror("setrlimit");
+}
+
+// Queues m for the room's members on this shard, except skip.
+static void deliver_local(struct room_ref room, struct msgbuf *m, struct conn *skip)
+{
+    struct room_local *r = &self->rooms[room.slot];
+    if (r->gen != room.gen)
+        return;     // the room is gone; its slot now holds another
+    for (int i = 0; i < r->count; i++) {
+        struct conn *dest = r->members[i];
+        if (dest == skip)
+            continue;
+        if (conn_push(dest, m) < 0)
+            i--;  // conn_close() moved the last member into slot i
+    }
+}
+
+// Mails m to the room's members on each shard in mask. Any thread.
+static void mail_room(struct room_ref room, struct msgbuf *m, uint64_t mask)
+{
+    while (mask) {
+        int i = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        struct mail *mail = malloc(sizeof(*mail));
+        if (!mail)
+            continue;
+        mail->type = MAIL_BROADCAST;
+        mail->room = room;
+        mail->msg = msgbuf_get(m);
+        mailbox_post(&shards[i].mailbox, mail);
+    }
+}
+
+// Sends m to the room but from: locally now, other shards by mail.
+static void broadcast(struct room_ref room, struct msgbuf *m, struct conn *from)
+{
+    deliver_local(room, m, from);
+    mail_room(room, m, room_shards(room.slot) & ~(1ull << self->id));
+}
+
+// A room message from sender as sent to its members, shared by all of them.
+static struct msgbuf *format_chat(int color, const char *text, uint32_t sender)
+{
+    struct msgbuf *m = msgbuf_new(LINE_MAX_LEN + 20); // extra space for escape characters
+    if (!m)
+        return NULL;
+    m->kind = WIRE_CHAT;
+    m->sender = sender;
+    m->body_off = snprintf(m->data, LINE_MAX_LEN + 20, "\033[47m\033[%dm", color);
+    m->body_len = strnlen(text, LINE_MAX_LEN);
+    m->len = m->body_off + snprintf(m->data + m->body_off, LINE_MAX_LEN + 20 - m->body_off,
+                                    "%.*s\033[0m\n", LINE_MAX_LEN, text);
+    return m;
+}
+
+/* A message from another node's client, on the relay thread. It goes to
+ * every shard by mail, and only if the room exists here. */
+static void deliver_remote(const char *name, int color, const char *user, const char *text)
+{
+    struct room_ref room;
+    if (room_find(name, &room) < 0)
+        return;
+    struct msgbuf *m = format_chat(color, text, WIRE_NO_SENDER);
+    if (!m)
+        return;
+    m->born = metrics_now();
+    room_record(room, m->data, m->len);
+    chatlog_append(name, user, text);
+    log_debug("[%s #%s] relayed: %s", user, name, text);
+    mail_room(room, m, room_shards(room.slot));
+    msgbuf_put(m);
+}
+
+// Hands m to fd if that is still a session of account on this shard.
+static void deliver_direct(int fd, int account, int from, struct msgbuf *m)
+{
+    struct conn *c = conn_at(fd);
+    if (!c || c->state != CONN_CHAT || c->account != account)
+        return;     // logged out (and maybe reused) since the lookup
+    c->reply_to = from;
+    conn_push(c, m);
+}
+
+static void handle_mail(void)
+{
+    struct mail *mail = mailbox_take(&self->mailbox);
+    while (mail) {
+        struct mail *next = mail->next;
+        switch (mail->type) {
+        case MAIL_BROADCAST:
+            deliver_local(mail->room, mail->msg, NULL);
+            break;
+        case MAIL_DIRECT:
+            deliver_direct(mail->fd, mail->account, mail->from, mail->msg);
+            break;
+        default:    // the relay thread's; never sent to a shard
+            break;
+        }
+        msgbuf_put(mail->msg);
+        free(mail);
+        mail = next;
+    }
+}
+
+// Sends c the room's last n messages in one write.
+static void send_history(struct conn *c, struct room_ref room, int n)
+{
+    struct msgbuf *m = room_history(room, n);
+    if (m && c->binary) {
+        // Recorded formatted; a binary client gets the bare messages.
+        struct msgbuf *bare = wire_history(m);
+        msgbuf_put(m);
+        m = bare;
+    }
+    if (m) {
+        conn_push(c, m);
+        msgbuf_put(m);
+    }
+}
+
+// Feed one line to a connection that has not logged in yet.
+static void handle_login(struct conn *c, const char *line)
+{
+    int user_index = login_input(c->fd, &c->session, line);
+    if (user_index == LOGIN_PENDING)
+        return;
+    if (user_index == LOGIN_EXIT) {
+        log_info("[%d] left from menu", c->fd);
+        conn_close(c);
+        return;
+    }
+    log_info("[Logged in] fd: %d, index: %d", c->fd, user_index);
+    if (conn_add(c, user_index, ROOM_LOBBY_NAME) < 0) {
+        log_error("[%d] out of memory logging in", c->fd);
+        conn_close(c);
+        return;
+    }
+    send_history(c, c->room, HISTORY_REPLAY);
+    timer_cancel(&self->timers, &c->timer);
+    conn_schedule(c);
+    // [CHANGE]: Color is now determined by the user’s account index.
+    c->color = 30 + (user_index % 7);
+}
+
+// Moves c from its current room to the one called name.
+static void join_room(struct conn *c, const char *name)
+{
+    char reply[ROOM_NAME_LEN + 64];
+    struct room_ref ref;
+    int err = room_join(name, &ref);
+    if (err == -1) {
+        client_send(c->fd, "Room names are 1-31 characters without spaces.\n");
+        return;
+    }
+    if (err < 0) {
+        client_send(c->fd, "Too many rooms, try again later.\n");
+        return;
+    }
+    if (ref.slot == c->room.slot) {
+        room_leave(ref);
+        snprintf(reply, sizeof(reply), "You are already in #%s.\n", name);
+        client_send(c->fd, reply);
+        return;
+    }
+    if (room_reserve(ref.slot) < 0) {
+        room_leave(ref);
+        client_send(c->fd, "Out of memory, try again later.\n");
+        return;
+    }
+    room_exit(c);
+    room_enter(c, ref);
+    snprintf(reply, sizeof(reply), "Joined #%s (%d member(s)).\n", name, room_members(ref.slot));
+    client_send(c->fd, reply);
+    send_history(c, ref, HISTORY_REPLAY);
+}
+
+/* Sends text privately to the newest session of account. The recipient's
+ * fd and shard come from the presence registry, so nothing is scanned. */
+static void send_direct(struct conn *c, int account, const char *text)
+{
+    char reply[MAX_USERNAME_LENGTH + 64];
+    int shard;
+    int dest_fd = presence_find(account, &shard);
+    if (dest_fd < 0) {
+        snprintf(reply, sizeof(reply), "%s is not online.\n", find_username(account));
+        client_send(c->fd, reply);
+        return;
+    }
+
+    struct msgbuf *m = msgbuf_new(MAX_USERNAME_LENGTH + LINE_MAX_LEN + 32);
+    if (!m)
+        return;
+    m->body_off = snprintf(m->data, MAX_USERNAME_LENGTH + LINE_MAX_LEN + 32,
+        "\033[35m[from %s]\033[0m ", find_username(c->account));
+    m->len = m->body_off + snprintf(m->data + m->body_off,
+                                    MAX_USERNAME_LENGTH + LINE_MAX_LEN + 32 - m->body_off,
+                                    "%.*s\n", LINE_MAX_LEN, text);
+    m->body_len = m->len - m->body_off - 1;
+    m->kind = WIRE_DIRECT;
+    m->sender = c->account;
+    m->born = self->loop_start;
+    if (&shards[shard] == self) {
+        deliver_direct(dest_fd, account, c->account, m);
+    } else {
+        struct mail *mail = malloc(sizeof(*mail));
+        if (mail) {
+            mail->type = MAIL_DIRECT;
+            mail->fd = dest_fd;
+            mail->account = account;
+            mail->from = c->account;
+            mail->msg = msgbuf_get(m);
+            mailbox_post(&shards[shard].mailbox, mail);
+        }
+    }
+    msgbuf_put(m);
+
+    if (c->state) {    // a local delivery may have evicted the sender
+        char echo[MAX_USERNAME_LENGTH + LINE_MAX_LEN + 32];
+        int off = snprintf(echo, sizeof(echo), "\033[35m[to %s]\033[0m ", find_username(account));
+        int n = off + snprintf(echo + off, sizeof(echo) - off, "%.*s\n", LINE_MAX_LEN, text);
+        struct msgbuf *e = msgbuf_from(echo, n);
+        if (e) {
+            e->kind = WIRE_DIRECT_SENT;
+            e->sender = account;
+            e->body_off = off;
+            e->body_len = n - off - 1;
+            conn_push(c, e);
+            msgbuf_put(e);
+        }
+    }
+}
+
+// /msg <user> <text>
+static void handle_msg(struct conn *c, char *args)
+{
+    char *text = strchr(args, ' ');
+    if (!text || text == args || text[1] == '\0') {
+        client_send(c->fd, "Usage: /msg <user> <text>\n");
+        return;
+    }
+    *text++ = '\0';
+    int account = find_account(args);
+    if (account < 0) {
+        client_send(c->fd, "User doesn't exist!\n");
+        return;
+    }
+    send_direct(c, account, text);
+}
+
+// /reply <text>, to whoever sent c the last direct message.
+static void handle_reply(struct conn *c, char *text)
+{
+    if (c->reply_to < 0) {
+        client_send(c->fd, "Nobody has messaged you yet.\n");
+        return;
+    }
+    if (*text == '\0') {
+        client_send(c->fd, "Usage: /reply <text>\n");
+        return;
+    }
+    send_direct(c, c->reply_to, text);
+}
+
+// A binary client's WIRE_DIRECT: /msg by account id rather than name.
+static void handle_wire_direct(struct conn *c, uint32_t account, const char *text)
+{
+    if (c->state == CONN_LOGIN || !text[0])
+        return;
+    if (account >= (uint32_t) db_size()) {
+        client_send(c->fd, "User doesn't exist!\n");
+        return;
+    }
+    send_direct(c, account, text);
+}
+
+// /log <minutes> [minutes]: replays the current room's chat log from that
+// many minutes ago until the second bound (default now).
+static void handle_log(struct conn *c, const char *args)
+{
+    char *end;
+    long since = strtol(args, &end, 10);
+    long until = *end ? strtol(end, &end, 10) : 0;
+    if (end == args || *end || since <= until || until < 0) {
+        client_send(c->fd, "Usage: /log <minutes ago> [until minutes ago]\n");
+        return;
+    }
+    if (!chatlog_enabled()) {
+        client_send(c->fd, "The chat log is turned off.\n");
+        return;
+    }
+    if (c->replay) {
+        client_send(c->fd, "A replay is already running.\n");
+        return;
+    }
+
+    struct chatlog_cursor *cur = malloc(sizeof(*cur));
+    time_t now = time(NULL);
+    if (!cur || chatlog_seek(cur, room_name(c->room.slot),
+                             now - since * 60, now - until * 60 + 1) < 0) {
+        free(cur);
+        client_send(c->fd, "Nothing was logged then.\n");
+        return;
+    }
+    c->replay = cur;
+    c->replay_pos = self->replay_count;
+    self->replaying[self->replay_count++] = c;
+}
+
+// The server's totals followed by c's own counters.
+static void send_stats(struct conn *c)
+{
+    struct msgbuf *report = metrics_report();
+    if (report) {
+        conn_push(c, report);
+        msgbuf_put(report);
+    }
+    struct sendq *q = &c->sendq;
+    char mine[160];
+    snprintf(mine, sizeof(mine),
+        "you: %llu lines in (%llu bytes), %zu messages out (%zu bytes sent), %zu dropped\n",
+        (unsigned long long) c->lines_in, (unsigned long long) c->bytes_in,
+        q->pushed, q->sent, q->dropped);
+    client_send(c->fd, mine);
+}
+
+/* Moves c's output to a shared-memory ring, for a bot on the Unix socket.
+ * The reply carries the ring's memfd and eventfd; the socket carries
+ * nothing after it. */
+static void handle_tap(struct conn *c)
+{
+    int domain = 0;
+    socklen_t len = sizeof(domain);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0 || domain != AF_UNIX) {
+        client_send(c->fd, "Only clients on the Unix socket can tap.\n");
+        return;
+    }
+    if (c->tap) {
+        client_send(c->fd, "Already tapped.\n");
+        return;
+    }
+    // The reply goes straight out, so nothing may be queued ahead of it.
+    if (!c->send_busy)
+        conn_flush(c);
+    if (!c->state)
+        return;
+    if (c->send_busy || c->sendq.count) {
+        client_send(c->fd, "Output still pending; try /tap again.\n");
+        return;
+    }
+    struct tap *t = malloc(sizeof(*t));
+    if (!t || tap_open(t, sendq_high) < 0) {
+        log_warn("[%d] can't set up a tap: %s", c->fd, strerror(errno));
+        free(t);
+        client_send(c->fd, "Can't set up a tap.\n");
+        return;
+    }
+    char reply[64];
+    int n = snprintf(reply, sizeof(reply), "Tapped: %u byte ring.\n", t->ring->size);
+    if (tap_send(t, c->fd, reply, n) < 0) {
+        tap_close(t);
+        free(t);
+        client_send(c->fd, "Can't hand over the tap; try /tap again.\n");
+        return;
+    }
+    log_info("[%d] tapped, %u byte ring", c->fd, t->ring->size);
+    c->tap = t;
+}
+
+// Handle one complete input line from c; may close connections.
+static void handle_line(struct conn *c, char *buf)
+{
+    if (c->state == CONN_LOGIN) {
+        handle_login(c, buf);
+        return;
+    }
+
+    // Check if it's a command
+    if(buf[0] == '/'){
+        if(strcmp(buf, "/online") == 0){
+            // Rendered once per membership change, shared by every asker.
+            struct msgbuf *online = presence_online_msg();
+            if (online) {
+                conn_push(c, online);
+                msgbuf_put(online);
+            }
+        }else if(strncmp(buf, "/msg ", 5) == 0){
+            handle_msg(c, buf + 5);
+        }else if(strcmp(buf, "/reply") == 0 || strncmp(buf, "/reply ", 7) == 0){
+            handle_reply(c, buf[6] ? buf + 7 : buf + 6);
+        }else if(strncmp(buf, "/join ", 6) == 0){
+            join_room(c, buf + 6);
+        }else if(strcmp(buf, "/leave") == 0){
+            if (c->room.slot == 0) {
+                client_send(c->fd, "You are already in the lobby.\n");
+            } else {
+                client_send(c->fd, "Left the room.\n");
+                join_room(c, ROOM_LOBBY_NAME);
+            }
+        }else if(strcmp(buf, "/history") == 0 || strncmp(buf, "/history ", 9) == 0){
+            int n = buf[8] ? atoi(buf + 9) : HISTORY_REPLAY;
+            if (n > 0)
+                send_history(c, c->room, n);
+            else
+                client_send(c->fd, "Usage: /history [n]\n");
+        }else if(strncmp(buf, "/log ", 5) == 0){
+            handle_log(c, buf + 5);
+        }else if(strcmp(buf, "/rooms") == 0){
+            struct msgbuf *list = rooms_list_msg();
+            if (list) {
+                conn_push(c, list);
+                msgbuf_put(list);
+            }
+        }else if(strcmp(buf, "/stats") == 0){
+            send_stats(c);
+        }else if(strcmp(buf, "/tap") == 0){
+            handle_tap(c);
+        }else if(strcmp(buf, "/binary") == 0){
+            if (!c->binary) {
+                // The last text reply; everything after it is framed.
+                client_send(c->fd, "Binary mode.\n");
+                c->binary = 1;
+                log_info("[%d] binary mode", c->fd);
+            }
+        }else if(strcmp(buf, "/hello") == 0){
+            client_send(c->fd, "Why hello!\n");
+        }
+        else{
+            client_send(c->fd, "Unknown command!\n");
+        }
+        // Since it's a command, we don't send anything to other users
+        return;
+    }
+
+    // Format once; every recipient's queue shares this buffer.
+    struct msgbuf *colored_msg = format_chat(c->color, buf, c->account);
+    if (!colored_msg)
+        return;
+    colored_msg->born = self->loop_start;
+
+    log_info("[%s #%s]: %s", find_username(c->account), room_name(c->room.slot), buf);
+
+    room_record(c->room, colored_msg->data, colored_msg->len);
+    chatlog_append(room_name(c->room.slot), find_username(c->account), buf);
+    broadcast(c->room, colored_msg, c);
+    relay_broadcast(room_name(c->room.slot), c->color, find_username(c->account), buf);
+    msgbuf_put(colored_msg);
+}
+
+
+/* Login happens in the event loop, one line at a time. Returns NULL, with
+ * fd closed, if there is no room for it. */
+static struct conn *conn_open(int fd)
+{
+    struct conn *c = conn_new(fd);
+    if (!c) {
+        close(fd);
+        return NULL;
+    }
+    c->heard_at = loop_ms();
+    c->bucket = (struct bucket) {msg_burst * 1000ll, byte_burst * 1000ll, c->heard_at};
+    if (login_timeout)
+        timer_arm(&self->timers, &c->timer, c->heard_at + login_timeout * 1000ull);
+    login_start(fd, &c->session);
+    return c;
+}
+
+/* Charges one line of n bytes to c's buckets. Returns how many ms it must
+ * wait before it may send more, or 0. */
+static uint64_t bucket_charge(struct conn *c, size_t n)
+{
+    struct bucket *b = &c->bucket;
+    uint64_t now = loop_ms(), wait = 0;
+    uint64_t dt = now - b->at;
+    b->at = now;
+    if (msg_rate) {
+        b->msgs += dt * msg_rate;
+        if (b->msgs > msg_burst * 1000ll)
+            b->msgs = msg_burst * 1000ll;
+        b->msgs -= 1000;
+        if (b->msgs < 0)
+            wait = (-b->msgs + msg_rate - 1) / msg_rate;
+    }
+    if (byte_rate) {
+        b->bytes += dt * byte_rate;
+        if (b->bytes > byte_burst * 1000ll)
+            b->bytes = byte_burst * 1000ll;
+        b->bytes -= n * 1000;
+        if (b->bytes < 0 && (uint64_t) (-b->bytes + byte_rate - 1) / byte_rate > wait)
+            wait = (-b->bytes + byte_rate - 1) / byte_rate;
+    }
+    return wait;
+}
+
+/* Hands every complete line in [start, end) to the connection, until its
+ * buckets run dry; then the rest is held and reads pause. */
+static void conn_input(struct conn *c, char *start, char *end)
+{
+    char *line;
+    c->heard_at = loop_ms();
+    for (;;) {
+        // Checked each time round: /binary takes effect mid-buffer.
+        struct wire_msg msg = {WIRE_CHAT, WIRE_NO_SENDER, false};
+        if (!c->state)
+            return;
+        line = c->binary ? wire_next(&c->in, &c->frame_left, &start, end, &msg)
+                          : linebuf_next(&c->in, &start, end);
+        if (msg.bad) {
+            log_warn("[%d] bad frame", c->fd);
+            conn_close(c);
+            return;
+        }
+        if (!line)
+            return;
+        size_t n = start - line;
+        c->lines_in++;
+        STAT_ADD(msgs_in, 1);
+        if (msg.type == WIRE_CHAT)
+            handle_line(c, line);
+        else if (msg.type == WIRE_DIRECT)
+            handle_wire_direct(c, msg.sender, line);
+        if (!(msg_rate || byte_rate) || !c->state)
+            continue;
+        uint64_t wait = bucket_charge(c, n);
+        if (wait) {
+            if (linebuf_hold(&c->in, start, end) < 0) {
+                conn_close(c);
+                return;
+            }
+            c->throttled = 1;
+            STAT_ADD(throttled, 1);
+            timer_arm(&self->timers, &c->resume_timer, loop_ms() + wait);
+            return;
+        }
+    }
+}
+
+// Logs a new connection from sa, as accept() or getpeername() gave it.
+static void log_connect(int fd, const struct sockaddr_storage *sa)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+    if (sa->ss_family == AF_INET)
+        log_info("[%d] connect from %s:%d (shard %d)", fd,
+            inet_ntoa(sin->sin_addr), ntohs(sin->sin_port), self->id);
+    else
+        log_info("[%d] connect on the Unix socket (shard %d)", fd, self->id);
+}
+
+// Edge-triggered: drain the whole accept queue.
+static void accept_clients(int listen_fd)
+{
+    for (;;) {
+        struct sockaddr_storage client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        int new_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &addrlen);
+        STAT_ADD(syscalls, 1);
+        if (new_fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_warn("accept: %s", strerror(errno));
+            return;
+        }
+        log_connect(new_fd, &client_addr);
+
+        int onoff = 1;
+        if (ioctl(new_fd, FIONBIO, &onoff) < 0) {
+            log_warn("fcntl(%d): %s", new_fd, strerror(errno));
+            close(new_fd);
+            continue;
+        }
+        // EPOLLOUT is edge-triggered too, so it only fires when a
+        // full socket buffer drains; no re-arming needed.
+        struct epoll_event cev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                                  .data.fd = new_fd};
+        if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, new_fd, &cev) < 0) {
+            log_warn("epoll_ctl(%d): %s", new_fd, strerror(errno));
+            close(new_fd);
+            continue;
+        }
+        conn_open(new_fd);
+    }
+}
+
+static void handle_client(struct conn *c, uint32_t events)
+{
+    if (events & EPOLLOUT) {
+        conn_flush(c);
+        if (!c->state || !(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            return;
+    }
+
+    log_debug("[%d] activity", c->fd);
+
+    // Edge-triggered: keep reading until the socket reports EAGAIN,
+    // splitting out every complete line as it arrives. A paused client's
+    // data stays in the socket, so conn_resume() picks up from here.
+    while (!c->throttled) {
+        char *start, *end;
+        ssize_t nread = linebuf_read(&c->in, c->fd, &start, &end);
+        STAT_ADD(syscalls, 1);
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_warn("read(%d): %s", c->fd, strerror(errno));
+                conn_close(c);
+            }
+            return;
+        } else if (nread == 0) {
+            log_info("[%d] closed", c->fd);
+            conn_close(c);
+            return;
+        }
+        c->bytes_in += nread;
+        STAT_ADD(bytes_in, nread);
+        conn_input(c, start, end);
+        if (!c->state)
+            return;
+    }
+}
+
+// Accounts for the iteration that started at loop_start.
+static void loop_done(void)
+{
+    uint64_t took = metrics_now() - self->loop_start;
+    STAT_ADD(loops, 1);
+    STAT_ADD(busy_ns, took);
+    STAT_RECORD(loop_ns, took);
+}
+
+static void shard_loop_epoll(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        // Sleep until the next timer is due, and not at all while a replay
+        // is waiting for its next chunk.
+        int timeout = timer_wheel_timeout(&self->timers, metrics_now() / 1000000);
+        if (self->replay_count && replay_hungry())
+            timeout = 0;
+        int nready = epoll_wait(self->epfd, events, MAX_EVENTS, timeout);
+        self->loop_start = metrics_now();
+        STAT_ADD(syscalls, 1);
+        if (nready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int e = 0; e < nready; e++) {
+            int fd = events[e].data.fd;
+            struct conn *c;
+            if (fd == self->listen_fd || fd == self->unix_fd)
+                accept_clients(fd);
+            else if (fd == self->mailbox.wake_fd)
+                handle_mail();
+            else if ((c = conn_at(fd)))  // else closed earlier in this batch
+                handle_client(c, events[e].events);
+        }
+
+        timer_wheel_advance(&self->timers, loop_ms());
+        // One gathered write per connection that got output this round.
+        flush_dirty();
+        if (self->id == 0)
+            db_poll();
+        // Nothing from this round points at a closed connection any more.
+        pool_trim(&self->conns);
+        loop_done();
+        if (atomic_load_explicit(&upgrade_asked, memory_order_relaxed))
+            return;
+    }
+}
+
+/* ===== io_uring backend =====
+ *
+ * The low bits of user_data say what completed. Receives also carry the
+ * fd and its connection's generation, so completions for a closed (and
+ * maybe reused) fd are recognised as stale. A send's user_data is its struct uring_send,
+ * which holds its own references to the messages being written, so a
+ * connection can be closed and its queue freed while the send is in flight. */
+enum { UD_SEND = 0, UD_ACCEPT = 1, UD_WAKE = 2, UD_RECV = 3, UD_TIMEOUT = 4, UD_CANCEL = 5 };
+#define UD_TYPE(ud) ((ud) & 7)
+#define UD_FD(ud) ((int) (((ud) >> 3) & 0x1fffffff))
+#define UD_GEN(ud) ((unsigned) ((ud) >> 32))
+
+struct uring_send {
+    int fd;
+    unsigned gen;
+    int n;
+    struct msghdr msg;
+    struct iovec iov[SENDQ_IOV];
+    struct msgbuf *held[SENDQ_IOV];
+};
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe = uring_sqe(&self->ring);
+    if (!sqe) {
+        fprintf(stderr, "shard %d: submission queue stuck full\n", self->id);
         exit(1);
     }
+    return sqe;
+}
+
+// fd's connection, if it is still the one of generation gen.
+static struct conn *conn_live(int fd, unsigned gen)
+{
+    struct conn *c = conn_at(fd);
+    return c && c->gen == gen ? c : NULL;
+}
+
+static uint64_t recv_ud(struct conn *c)
+{
+    return (uint64_t) c->gen << 32 | (uint64_t) c->fd << 3 | UD_RECV;
+}
+
+static void uring_arm_recv(struct conn *c)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    uring_prep_recv_multishot(sqe, c->fd);
+    sqe->user_data = recv_ud(c);
+}
+
+// The accept's user_data carries the listener, as a recv's does its fd.
+static uint64_t accept_ud(int listen_fd)
+{
+    return (uint64_t) listen_fd << 3 | UD_ACCEPT;
+}
+
+static void uring_arm_accept(int listen_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    uring_prep_accept_multishot(sqe, listen_fd);
+    sqe->user_data = accept_ud(listen_fd);
+    self->accepting++;
+}
+
+static void uring_arm_accepts(void)
+{
+    uring_arm_accept(self->listen_fd);
+    if (self->unix_fd >= 0)
+        uring_arm_accept(self->unix_fd);
+}
+
+static void uring_arm_wake(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    uring_prep_poll_multishot(sqe, self->mailbox.wake_fd);
+    sqe->user_data = UD_WAKE;
+}
+
+/* Makes sure the loop wakes up within ms. A timeout's user_data carries the
+ * time it fires, so a superseded one is told apart when it completes. */
+static void uring_arm_timeout(int ms)
+{
+    uint64_t now = metrics_now() / 1000000;
+    if (self->timeout_at && self->timeout_at <= now + ms)
+        return;     // the armed one is soon enough
+    self->timeout_at = now + ms;
+    self->timeout.tv_sec = ms / 1000;
+    self->timeout.tv_nsec = ms % 1000 * 1000000L;
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    uring_prep_timeout(sqe, &self->timeout);
+    sqe->user_data = self->timeout_at << 3 | UD_TIMEOUT;
+}
+
+// Queues one gathered sendmsg for c's pending output, unless one is running.
+static void uring_start_send(struct conn *c)
+{
+    struct sendq *q = &c->sendq;
+    if (!c->state || c->send_busy || q->count == 0 || self->stopped)
+        return;
+    struct uring_send *us = malloc(sizeof(*us));
+    if (!us) {
+        conn_close(c);
+        return;
+    }
+    us->fd = c->fd;
+    us->gen = c->gen;
+    us->n = sendq_iov(q, us->iov, us->held, SENDQ_IOV);
+    memset(&us->msg, 0, sizeof(us->msg));
+    us->msg.msg_iov = us->iov;
+    us->msg.msg_iovlen = us->n;
+    q->pinned = us->n;
+    c->send_busy = us;
+
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    uring_prep_sendmsg(sqe, c->fd, &us->msg, MSG_NOSIGNAL);
+    sqe->user_data = (uint64_t) (uintptr_t) us;
+}
+
+static void uring_send_done(struct uring_send *us, int res)
+{
+    struct conn *c = conn_live(us->fd, us->gen);
+    if (c) {
+        c->send_busy = NULL;
+        c->sendq.pinned = 0;
+        if (res == -ECANCELED && self->stopped) {
+            // Stopped for an upgrade; the output goes over unsent.
+        } else if (res < 0) {
+            log_warn("send(%d): %s", c->fd, strerror(-res));
+            conn_close(c);
+        } else {
+            sendq_consume(&c->sendq, res);
+            uring_start_send(c);  // whatever queued up meanwhile
+        }
+    }
+    for (int i = 0; i < us->n; i++)
+        msgbuf_put(us->held[i]);
+    free(us);
+}
+
+/* A multishot recv can't be paused, so a throttled client's is cancelled
+ * (RECV_CANCELLING) and not re-armed once it ends (RECV_STOPPED) until
+ * conn_resume(). Data that was already on its way is held. The same goes
+ * for every client of a shard stopping for an upgrade. */
+enum { RECV_CANCELLING = 1, RECV_STOPPED };
+
+static bool recv_held(struct conn *c)
+{
+    return c->throttled || self->stopped;
+}
+
+static void uring_recv_done(uint64_t ud, int res, unsigned flags)
+{
+    struct conn *c = conn_live(UD_FD(ud), UD_GEN(ud));
+    bool live = c != NULL;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        char *data = uring_buf(&self->ring, bid);
+        if (live && res > 0 && (recv_held(c) || linebuf_holding(&c->in))) {
+            c->bytes_in += res;
+            STAT_ADD(bytes_in, res);
+            if (linebuf_stash(&c->in, data, res) < 0)
+                conn_close(c);
+            uring_buf_recycle(&self->ring, bid);
+        } else if (live && res > 0) {
+            char *start, *end;
+            c->bytes_in += res;
+            STAT_ADD(bytes_in, res);
+            linebuf_feed(&c->in, data, res, &start, &end);
+            uring_buf_recycle(&self->ring, bid);
+            conn_input(c, start, end);
+        } else {
+            uring_buf_recycle(&self->ring, bid);
+        }
+    }
+    if (!live || !c->state)
+        return;
+    if (res == 0) {
+        log_info("[%d] closed", c->fd);
+        conn_close(c);
+    } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        log_warn("recv(%d): %s", c->fd, strerror(-res));
+        conn_close(c);
+    } else if (!(flags & IORING_CQE_F_MORE)) {
+        // Ran out of buffers, was cancelled, or the kernel ended it.
+        if (recv_held(c)) {
+            c->recv_paused = RECV_STOPPED;
+        } else {
+            c->recv_paused = 0;
+            uring_arm_recv(c);
+        }
+    } else if (recv_held(c) && !c->recv_paused) {
+        struct io_uring_sqe *sqe = uring_get_sqe();
+        uring_prep_cancel(sqe, ud);
+        sqe->user_data = UD_CANCEL;
+        c->recv_paused = RECV_CANCELLING;
+    }
+}
+
+static void uring_accept_done(uint64_t ud, int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE)) {
+        self->accepting--;
+        if (!self->stopped)
+            uring_arm_accept(UD_FD(ud));
+    }
+    if (res == -ECANCELED)
+        return;
+    if (res < 0) {
+        log_warn("accept: %s", strerror(-res));
+        return;
+    }
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getpeername(res, (struct sockaddr *) &addr, &addrlen) == 0)
+        log_connect(res, &addr);
+    // The socket stays blocking: io_uring waits for readiness itself, and
+    // direct sends use MSG_DONTWAIT.
+    struct conn *c = conn_open(res);
+    if (!c)
+        return;
+    if (self->stopped)
+        c->recv_paused = RECV_STOPPED;
+    else
+        uring_arm_recv(c);
+}
+
+// Handles every completion that is in.
+static void uring_reap(void)
+{
+    struct io_uring_cqe *cqe;
+    // Completions keep coming in while these are handled; a bounded batch
+    // at a time, so a busy shard still gets round to its timers.
+    for (unsigned n = 0; n < self->ring.sq_entries && (cqe = uring_peek(&self->ring)); n++) {
+        uint64_t ud = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_cqe_seen(&self->ring);
+
+        switch (UD_TYPE(ud)) {
+        case UD_SEND:
+            uring_send_done((struct uring_send *) (uintptr_t) ud, res);
+            break;
+        case UD_RECV:
+            uring_recv_done(ud, res, flags);
+            break;
+        case UD_ACCEPT:
+            uring_accept_done(ud, res, flags);
+            break;
+        case UD_WAKE:
+            handle_mail();
+            if (!(flags & IORING_CQE_F_MORE))
+                uring_arm_wake();
+            break;
+        case UD_TIMEOUT:
+            if (ud >> 3 == self->timeout_at)
+                self->timeout_at = 0;
+            break;
+        case UD_CANCEL:
+            break;
+        }
+    }
+}
+
+/* For an upgrade: ends the accepts and every recv and send in flight, so
+ * nothing is left in the ring that the new process would miss. A send is
+ * cancelled rather than waited out, as a client that has stopped reading
+ * would hold it up for good; what it had not written stays queued. Whatever
+ * arrives meanwhile is held, as for a throttled client. */
+static void uring_stop(void)
+{
+    self->stopped = true;
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    uring_prep_cancel(sqe, accept_ud(self->listen_fd));
+    sqe->user_data = UD_CANCEL;
+    if (self->unix_fd >= 0) {
+        sqe = uring_get_sqe();
+        uring_prep_cancel(sqe, accept_ud(self->unix_fd));
+        sqe->user_data = UD_CANCEL;
+    }
+    struct conn *c;
+    for (int fd = 0; (c = conn_scan(&fd)); fd++) {
+        if (!c->recv_paused) {
+            sqe = uring_get_sqe();
+            uring_prep_cancel(sqe, recv_ud(c));
+            sqe->user_data = UD_CANCEL;
+            c->recv_paused = RECV_CANCELLING;
+        }
+        if (c->send_busy) {
+            sqe = uring_get_sqe();
+            uring_prep_cancel(sqe, (uint64_t) (uintptr_t) c->send_busy);
+            sqe->user_data = UD_CANCEL;
+        }
+    }
+    // Nothing new is started, so a connection once done stays done.
+    int fd = 0;
+    for (;;) {
+        while ((c = conn_scan(&fd)) && !c->send_busy && c->recv_paused == RECV_STOPPED)
+            fd++;
+        if (!c && !self->accepting)
+            return;
+        if (uring_submit_and_wait(&self->ring) < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+        uring_reap();
+    }
+}
+
+// Undoes uring_stop() when the upgrade fell through.
+static void uring_resume(void)
+{
+    self->stopped = false;
+    uring_arm_accepts();
+    struct conn *c;
+    for (int fd = 0; (c = conn_scan(&fd)); fd++) {
+        if (!c->throttled)
+            conn_resume(&c->resume_timer);
+        uring_start_send(c);
+    }
+}
+
+static void shard_loop_uring(void)
+{
+    if (self->stopped) {
+        uring_resume();
+    } else {
+        uring_arm_accepts();
+        uring_arm_wake();
+    }
+    for (;;) {
+        int timeout = timer_wheel_timeout(&self->timers, metrics_now() / 1000000);
+        if (timeout >= 0)
+            uring_arm_timeout(timeout);
+        int ret = uring_submit_and_wait(&self->ring);
+        self->loop_start = metrics_now();
+        STAT_ADD(syscalls, 1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("io_uring_enter");
+            exit(1);
+        }
+        uring_reap();
+        timer_wheel_advance(&self->timers, loop_ms());
+
+        // Queue one sendmsg per connection with new output; the next
+        // io_uring_enter() submits them all together.
+        flush_dirty();
+        if (self->id == 0)
+            db_poll();
+        // Nothing from this round points at a closed connection any more.
+        pool_trim(&self->conns);
+        loop_done();
+        if (atomic_load_explicit(&upgrade_asked, memory_order_relaxed)) {
+            uring_stop();
+            return;
+        }
+    }
+}
+
+/* Lets a paused client go on: first the lines it held, then reading.
+ * With io_uring its recv comes back once the cancelled one has ended. */
+static void conn_resume(struct timer *t)
+{
+    struct conn *c = (struct conn *) ((char *) t - offsetof(struct conn, resume_timer));
+    char *start, *end;
+    c->throttled = 0;
+    while (c->state && !c->throttled && linebuf_unhold(&c->in, &start, &end))
+        conn_input(c, start, end);
+    if (!c->state || c->throttled)
+        return;
+    if (backend == BACKEND_EPOLL) {
+        handle_client(c, EPOLLIN);
+    } else if (c->recv_paused == RECV_STOPPED) {
+        c->recv_paused = 0;
+        uring_arm_recv(c);
+    }
+}
+
+// Makes sh the calling thread's shard.
+static void shard_enter(struct shard *sh)
+{
+    self = sh;
+    stats_self = &sh->stats;
+}
+
+// Runs until an upgrade is asked for; can be started again after one.
+static void *shard_loop(void *arg)
+{
+    shard_enter(arg);
+    if (backend == BACKEND_URING)
+        shard_loop_uring();
+    else
+        shard_loop_epoll();
+    return NULL;
+}
 
+// Opens one of the shards' listening sockets; they all share the port.
+static int open_listener(int port)
+{
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) {
         perror("socket");
-        exit(1);
+        return -1;
     }
     int onoff = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &onoff, sizeof(onoff)) < 0) {
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &onoff, sizeof(onoff)) < 0 ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &onoff, sizeof(onoff)) < 0) {
         perror("setsockopt");
-        exit(1);
+        return -1;
     }
     struct sockaddr_in sin = {
         .sin_family = AF_INET,
@@ -51,134 +1778,704 @@ int main(int argc, char **argv)
     };
     if (bind(server_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
         perror("bind");
-        exit(1);
+        return -1;
+    }
+    if (ioctl(server_fd, FIONBIO, &onoff) < 0) {
+        perror("ioctl");
+        return -1;
     }
-    if (listen(server_fd, 10) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("listen");
-        exit(1);
+        return -1;
     }
-    printf("listening on port %d\n", port);
-
-    int conns[FD_SETSIZE];
-    memset(conns, 0, sizeof(conns));
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(server_fd, &rfds);
-    int max_fd = server_fd + 1;
-
-    while (select(max_fd, &rfds, NULL, NULL, NULL) >= 0) {
-        if (FD_ISSET(server_fd, &rfds)) {
-            struct sockaddr_in client_addr;
-            socklen_t addrlen = sizeof(client_addr);
-            int new_fd = accept(server_fd, (struct sockaddr *)&client_addr, &addrlen);
-            if (new_fd < 0) {
-                perror("accept");
-            } else {
-                printf("[%d] connect from %s:%d\n", new_fd,
-                    inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-                
-                // Welcome message
-                client_printer(new_fd);
-                // Show home menu
-                int user_index = client_Homemenu(new_fd);
-                if (user_index == -1) {
-                    close(new_fd);
-                    continue;
-                }
-                fd_to_index[new_fd] = user_index;
-                // Addd to online_fd, marking user as online
-                online_fd[user_count++] = new_fd;
-                printf("[Logged in] fd: %d, index: %d\n", new_fd, user_index);
-
-                int onoff = 1;
-                if (ioctl(new_fd, FIONBIO, &onoff) < 0) {
-                    printf("fcntl(%d): %s\n", new_fd, strerror(errno));
-                    close(new_fd);
-                    continue;
+    return server_fd;
+}
+
+// The Unix socket listener at path, replacing a socket an earlier run left.
+static int open_unix_listener(const char *path)
+{
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: too long for a Unix socket path\n", path);
+        return -1;
+    }
+    strcpy(sun.sun_path, path);
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if (bind(server_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+        perror(path);
+        return -1;
+    }
+    int onoff = 1;
+    if (ioctl(server_fd, FIONBIO, &onoff) < 0) {
+        perror("ioctl");
+        return -1;
+    }
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("listen");
+        return -1;
+    }
+    return server_fd;
+}
+
+static int shard_init(struct shard *sh, int id, int listen_fd, int unix_fd)
+{
+    sh->id = id;
+    sh->listen_fd = listen_fd;
+    sh->unix_fd = unix_fd;
+    sh->rooms = calloc(ROOM_MAX, sizeof(*sh->rooms));
+    if (!sh->rooms)
+        return -1;
+    pool_init(&sh->conns, sizeof(struct conn), CONN_SLAB);
+    metrics_register(&sh->stats);
+    sh->loop_start = metrics_now();
+    timer_wheel_init(&sh->timers, sh->loop_start / 1000000);
+    if (mailbox_init(&sh->mailbox) < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    if (backend == BACKEND_URING) {
+        if (uring_init(&sh->ring, 4096, 1024, 16384) == 0)
+            return 0;
+        if (id > 0) {
+            fprintf(stderr, "shard %d: io_uring setup failed\n", id);
+            return -1;
+        }
+        log_info("io_uring not supported here, using epoll");
+        backend = BACKEND_EPOLL;
+    }
+    sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sh->epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.fd = sh->listen_fd};
+    struct epoll_event wev = {.events = EPOLLIN | EPOLLET, .data.fd = sh->mailbox.wake_fd};
+    struct epoll_event uev = {.events = EPOLLIN | EPOLLET, .data.fd = sh->unix_fd};
+    if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->listen_fd, &ev) < 0 ||
+        epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->mailbox.wake_fd, &wev) < 0 ||
+        (sh->unix_fd >= 0 && epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->unix_fd, &uev) < 0)) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/* ===== Hot upgrade =====
+ *
+ * The state file is a struct upgrade_head, then a struct upgrade_conn per
+ * connection in the order their sockets are passed, each followed by
+ * in_len bytes of input not yet handled and then out_count queued messages,
+ * each a uint32_t length and its bytes. Times are CLOCK_MONOTONIC ms, which
+ * both processes share. Bump UPGRADE_VERSION whenever any of this changes.
+ *
+ * After the state file come the shards' listeners, the Unix socket's if
+ * there is one, the connections, and then each tapped connection's memfd
+ * and eventfd, in the same order as the connections. */
+#define UPGRADE_MAGIC 0x63686174u   // "chat"
+#define UPGRADE_VERSION 4
+
+struct upgrade_head {
+    uint32_t magic, version;
+    int32_t nlisten, nunix, nconns, ntaps;  // descriptors passed, by kind
+};
+
+struct upgrade_conn {
+    int32_t shard, state;
+    int32_t login_state, login_index;
+    char username[MAX_USERNAME_LENGTH];
+    int32_t account, color, reply_to;   // CONN_CHAT
+    char room[ROOM_NAME_LEN];
+    uint64_t heard_at, timer_at, resume_at;     // 0 for a timer not armed
+    int64_t msgs, bytes;
+    uint64_t refilled_at;
+    uint64_t lines_in, bytes_in, pushed, sent, dropped;
+    uint64_t replay_off, replay_end, replay_check;  // a /log replay, if end > off
+    char replay_from[20], replay_to[20], replay_room[ROOM_NAME_LEN];
+    uint8_t replay_started, throttled, tapped, binary;
+    uint32_t frame_left;    // of a binary client's current input frame
+    uint32_t in_len, out_count;
+};
+
+// Returns -1 if out of memory.
+static int save_conn(FILE *f, struct conn *c)
+{
+    static struct iovec *iov;
+    static unsigned iov_cap;
+    struct upgrade_conn u;
+    memset(&u, 0, sizeof(u));   // padding too
+    u.shard = c->shard;
+    u.state = c->state;
+    u.login_state = c->session.state;
+    u.login_index = c->session.index;
+    memcpy(u.username, c->session.username, sizeof(u.username));
+    if (c->state == CONN_CHAT) {
+        u.account = c->account;
+        u.color = c->color;
+        u.reply_to = c->reply_to;
+        snprintf(u.room, sizeof(u.room), "%s", room_name(c->room.slot));
+    }
+    u.heard_at = c->heard_at;
+    if (timer_pending(&c->timer))
+        u.timer_at = timer_expiry(&c->timer);
+    if (timer_pending(&c->resume_timer))
+        u.resume_at = timer_expiry(&c->resume_timer);
+    u.msgs = c->bucket.msgs;
+    u.bytes = c->bucket.bytes;
+    u.refilled_at = c->bucket.at;
+    u.lines_in = c->lines_in;
+    u.bytes_in = c->bytes_in;
+    struct sendq *q = &c->sendq;
+    u.pushed = q->pushed;
+    u.sent = q->sent;
+    u.dropped = q->dropped;
+    struct chatlog_cursor *r = c->replay;
+    if (r) {
+        u.replay_off = r->off;
+        u.replay_end = r->end;
+        u.replay_check = r->check_from;
+        memcpy(u.replay_from, r->from, sizeof(u.replay_from));
+        memcpy(u.replay_to, r->to, sizeof(u.replay_to));
+        memcpy(u.replay_room, r->room, sizeof(u.replay_room));
+        u.replay_started = r->started;
+    }
+    u.throttled = c->throttled;
+    u.tapped = c->tap != NULL;
+    u.binary = c->binary;
+    u.frame_left = c->frame_left;
+    // The partial line comes first: held input arrived after it.
+    struct linebuf *lb = &c->in;
+    size_t held = lb->held_len - lb->held_off;
+    u.in_len = lb->len + held;
+    u.out_count = q->count;
+    fwrite(&u, sizeof(u), 1, f);
+    if (lb->len)
+        fwrite(lb->partial, 1, lb->len, f);
+    if (held)
+        fwrite(lb->held + lb->held_off, 1, held, f);
+
+    if (q->count > iov_cap) {
+        free(iov);
+        iov_cap = q->count;
+        if (!(iov = malloc(sizeof(*iov) * iov_cap))) {
+            iov_cap = 0;
+            return -1;
+        }
+    }
+    int n = sendq_iov(q, iov, NULL, q->count);
+    for (int i = 0; i < n; i++) {
+        uint32_t len = iov[i].iov_len;
+        fwrite(&len, sizeof(len), 1, f);
+        fwrite(iov[i].iov_base, 1, len, f);
+    }
+    return 0;
+}
+
+/* Picks up fd, one of the old process's connections, as u describes;
+ * tap_fds are its ring's, if it was tapped. */
+static int restore_conn(FILE *f, int fd, const struct upgrade_conn *u, const int *tap_fds)
+{
+    shard_enter(&shards[u->shard % nshards]);
+    char *in = malloc(u->in_len ? u->in_len : 1);
+    if (!in || fread(in, 1, u->in_len, f) != u->in_len) {
+        free(in);
+        return -1;
+    }
+
+    // Its output is read regardless, to get to the next connection's.
+    struct conn *c = conn_new(fd);
+    if (!c) {
+        close(fd);
+        if (u->tapped) {
+            close(tap_fds[0]);
+            close(tap_fds[1]);
+        }
+    } else {
+        c->binary = u->binary;
+        c->frame_left = u->frame_left;
+        c->session.state = u->login_state;
+        c->session.index = u->login_index;
+        memcpy(c->session.username, u->username, sizeof(u->username));
+        c->heard_at = u->heard_at;
+        c->bucket = (struct bucket) {u->msgs, u->bytes, u->refilled_at};
+        c->lines_in = u->lines_in;
+        c->bytes_in = u->bytes_in;
+    }
+    if (c && u->tapped) {
+        // Its bot goes on reading the same ring.
+        c->tap = malloc(sizeof(*c->tap));
+        if (!c->tap || tap_attach(c->tap, tap_fds[0], tap_fds[1]) < 0) {
+            free(c->tap);
+            c->tap = NULL;
+            conn_close(c);
+        }
+    }
+    if (c && c->state && u->state == CONN_CHAT && (u->account >= db_size() ||
+        (conn_add(c, u->account, u->room) < 0 && conn_add(c, u->account, ROOM_LOBBY_NAME) < 0)))
+        conn_close(c);
+    if (c && c->state == CONN_CHAT) {
+        c->color = u->color;
+        c->reply_to = u->reply_to;
+    }
+    // Nothing is read until what was already read is handled.
+    if (c && c->state && u->in_len && linebuf_stash(&c->in, in, u->in_len) < 0)
+        conn_close(c);
+    free(in);
+    if (c && c->state && (u->in_len || u->throttled)) {
+        c->throttled = 1;
+        timer_arm(&self->timers, &c->resume_timer, u->resume_at ? u->resume_at : loop_ms());
+    }
+    if (c && c->state && u->replay_end > u->replay_off) {
+        struct chatlog_cursor *r = calloc(1, sizeof(*r));
+        if (r) {
+            r->off = u->replay_off;
+            r->end = u->replay_end;
+            r->check_from = u->replay_check;
+            r->started = u->replay_started;
+            memcpy(r->from, u->replay_from, sizeof(r->from));
+            memcpy(r->to, u->replay_to, sizeof(r->to));
+            memcpy(r->room, u->replay_room, sizeof(r->room));
+            r->room[sizeof(r->room) - 1] = '\0';
+            c->replay = r;
+            c->replay_pos = self->replay_count;
+            self->replaying[self->replay_count++] = c;
+        }
+    }
+
+    for (uint32_t i = 0; i < u->out_count; i++) {
+        uint32_t len;
+        struct msgbuf *m = NULL;
+        if (fread(&len, sizeof(len), 1, f) != 1 || !(m = msgbuf_new(len)) ||
+            fread(m->data, 1, len, f) != len) {
+            if (m)
+                msgbuf_put(m);
+            if (c && c->state)
+                conn_close(c);
+            return -1;
+        }
+        m->len = len;
+        m->kind = WIRE_FRAMED;  // already as it goes out, whatever the mode
+        if (c && c->state)
+            conn_push(c, m);
+        msgbuf_put(m);
+    }
+    if (!c || !c->state)
+        return 0;
+    c->sendq.pushed = u->pushed;
+    c->sendq.sent = u->sent;
+    c->sendq.dropped = u->dropped;
+
+    if (backend == BACKEND_URING) {
+        if (c->throttled)
+            c->recv_paused = RECV_STOPPED;
+        else
+            uring_arm_recv(c);
+    } else {
+        int onoff = 1;
+        struct epoll_event cev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                                  .data.fd = fd};
+        if (ioctl(fd, FIONBIO, &onoff) < 0 || epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &cev) < 0) {
+            log_warn("[%d] taking over: %s", fd, strerror(errno));
+            conn_close(c);
+            return 0;
+        }
+    }
+    // Under this process's settings; may send a keepalive or kick it.
+    if (u->timer_at && c->state == CONN_LOGIN)
+        timer_arm(&self->timers, &c->timer, u->timer_at);
+    else if (c->state == CONN_CHAT)
+        conn_schedule(c);
+    return 0;
+}
+
+/* Runs a new copy of the server and hands it everything, with every shard
+ * stopped. Returns -1 if it did not take over, and this process goes on. */
+static int hand_off(void)
+{
+    if (!db_file) {
+        log_error("upgrade: accounts are only in memory (-d -), not upgrading");
+        return -1;
+    }
+    // Nothing more comes in from other nodes until this is over.
+    relay_pause();
+    // The new process loads both from disk.
+    while (db_poll())
+        usleep(1000);
+    chatlog_flush();
+
+    // It starts up while the state is being written.
+    pid_t pid;
+    int link = upgrade_spawn(server_argv, &pid);
+    if (link < 0) {
+        log_error("upgrade: can't run %s: %s", server_argv[0], strerror(errno));
+        relay_resume();
+        return -1;
+    }
+
+    // Mail that came in before its shard stopped or the relay paused; no one
+    // can post any more.
+    for (int i = 0; i < nshards; i++) {
+        shard_enter(&shards[i]);
+        handle_mail();
+    }
+
+    size_t nfds = 1 + nshards + 1;
+    struct conn *c;
+    for (int i = 0; i < nshards; i++) {
+        shard_enter(&shards[i]);
+        for (int fd = 0; (c = conn_scan(&fd)); fd++)
+            nfds += c->tap ? 3 : 1;
+    }
+    int *fds = malloc(sizeof(int) * nfds);
+    int state = memfd_create("chat-upgrade", MFD_CLOEXEC);
+    FILE *f = state >= 0 ? fdopen(state, "w") : NULL;
+    bool ok = fds && f;
+    struct upgrade_head head = {UPGRADE_MAGIC, UPGRADE_VERSION, nshards, 0, 0, 0};
+    int n = 0;
+    if (ok) {
+        fds[n++] = state;
+        for (int i = 0; i < nshards; i++)
+            fds[n++] = shards[i].listen_fd;
+        if (shards[0].unix_fd >= 0) {
+            fds[n++] = shards[0].unix_fd;
+            head.nunix = 1;
+        }
+        fwrite(&head, sizeof(head), 1, f);
+        for (int i = 0; i < nshards; i++) {
+            shard_enter(&shards[i]);
+            for (int fd = 0; ok && (c = conn_scan(&fd)); fd++) {
+                ok = save_conn(f, c) == 0;
+                fds[n++] = fd;
+                head.nconns++;
+            }
+        }
+        // Their rings, in the same order.
+        for (int i = 0; i < nshards; i++) {
+            shard_enter(&shards[i]);
+            for (int fd = 0; ok && (c = conn_scan(&fd)); fd++) {
+                if (c->tap) {
+                    fds[n++] = c->tap->memfd;
+                    fds[n++] = c->tap->eventfd;
+                    head.ntaps++;
                 }
-                conns[new_fd] = 1;
-                // [CHANGE]: Color is now determined by the user’s account index.
-                client_colors[new_fd] = 30 + (user_index % 7);
             }
         }
-        
+        rewind(f);
+        fwrite(&head, sizeof(head), 1, f);
+        ok = ok && fflush(f) == 0 && !ferror(f);
+    }
+    if (ok && (upgrade_send(link, fds, n) < 0 || upgrade_wait(link) < 0)) {
+        log_error("upgrade: new process (pid %d) did not take over", (int) pid);
+        ok = false;
+    } else if (!ok) {
+        log_error("upgrade: can't write state: %s", strerror(errno));
+    }
+    if (f)
+        fclose(f);
+    else if (state >= 0)
+        close(state);
+    free(fds);
+    close(link);
+    if (!ok) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        relay_resume();
+        return -1;
+    }
+    log_info("upgrade: pid %d took over %d connection(s), %.1f ms after the signal",
+             (int) pid, head.nconns, (metrics_now() - upgrade_at) / 1e6);
+    return 0;
+}
 
-        for (int fd = 0; fd < FD_SETSIZE; fd++) {
-            if (!conns[fd])
-                continue;
+/* New process, before the shards are set up: receives the old one's
+ * sockets and checks the head of its state file. */
+static FILE *upgrade_receive(int link, int **fds, struct upgrade_head *head)
+{
+    int n = upgrade_recv(link, fds);
+    FILE *f = n > 0 ? fdopen((*fds)[0], "r") : NULL;
+    // The old process left the shared file offset at the end.
+    if (!f || fseek(f, 0, SEEK_SET) < 0 || fread(head, sizeof(*head), 1, f) != 1 ||
+        head->magic != UPGRADE_MAGIC || head->version != UPGRADE_VERSION ||
+        head->nlisten < 1 || 1 + head->nlisten + head->nunix + head->nconns + 2 * head->ntaps != n) {
+        fprintf(stderr, "upgrade: nothing usable came from the old process\n");
+        exit(1);
+    }
+    return f;
+}
+
+// Then, with the shards set up: picks up every connection and says so.
+static void upgrade_restore(int link, FILE *f, const int *fds, const struct upgrade_head *head)
+{
+    uint64_t start = metrics_now();
+    const int *conn_fds = fds + 1 + head->nlisten + head->nunix;
+    const int *tap_fds = conn_fds + head->nconns;
+    int taps_left = head->ntaps;
+    for (int i = 0; i < head->nconns; i++) {
+        struct upgrade_conn u;
+        if (fread(&u, sizeof(u), 1, f) != 1 || (u.tapped && taps_left-- == 0) ||
+            restore_conn(f, conn_fds[i], &u, tap_fds) < 0) {
+            fprintf(stderr, "upgrade: state file cut short\n");
+            exit(1);
+        }
+        if (u.tapped)
+            tap_fds += 2;
+    }
+    fclose(f);
+    if (upgrade_ack(link) < 0) {
+        perror("upgrade");
+        exit(1);
+    }
+    close(link);
+    log_info("upgrade: took over %d connection(s) in %.1f ms", head->nconns,
+             (metrics_now() - start) / 1e6);
+}
+
+static void on_sigusr2(int sig)
+{
+    (void) sig;
+    upgrade_at = metrics_now();
+    atomic_store(&upgrade_asked, true);
+    uint64_t one = 1;
+    for (int i = 0; i < nshards; i++)
+        (void) !write(shards[i].mailbox.wake_fd, &one, sizeof(one));
+}
 
-            if (FD_ISSET(fd, &rfds)) {
-                printf("[%d] activity\n", fd);
 
-                char buf[1024];
-                int nread = read(fd, buf, sizeof(buf));
-                if (nread < 0) {
-                    fprintf(stderr, "read(%d): %s\n", fd, strerror(errno));
-                    close(fd);
-                    conns[fd] = 0;
-                }
-                
-                else if (nread > 0) {
-                    // Making sure that there IS a '\0'
-                    buf[nread-1] = '\0';
-
-
-                    // Check if it's a command
-                    if(buf[0] == '/'){
-                        char msg[1024];
-                        if(strcmp(buf, "/online") == 0){
-                            sprintf(msg, "Current online users (%d user(s)): \n", user_count);
-                            client_send(fd, msg);
-                            for(int i=0; i<user_count; i++) {
-                                sprintf(msg, "- %s \n", find_username(fd_to_index[online_fd[i]]));
-                                client_send(fd, msg);
-                            }
-                        }else if(strcmp(buf, "/hello") == 0){
-                            client_send(fd, "Why hello!\n");
-                        }
-                        else{
-                            client_send(fd, "Unknown command!\n");
-                        }
-                        // Since it's a command, we don't send anything to other users
-                        continue;
-                    }
-                    
-                    char colored_msg[1024 + 20]; // extra space for escape characters
-                    int colored_len = snprintf(colored_msg, sizeof(colored_msg),
-                        "\033[47m\033[%dm%s\033[0m\n", client_colors[fd], buf);
-
-                    printf("[%s]: %s\n", find_username(fd_to_index[fd]), colored_msg);
-
-
-                    for (int dest_fd = 0; dest_fd < FD_SETSIZE; dest_fd++) {
-                        if (conns[dest_fd] && dest_fd != fd) {
-                            if (write(dest_fd, colored_msg, colored_len) < 0) {
-                                fprintf(stderr, "write(%d): %s\n", dest_fd, strerror(errno));
-                                close(dest_fd);
-                                conns[dest_fd] = 0;
-                            }
-                        }
-                    }
-                } else {
-                    printf("[%d] closed\n", fd);
-                    close(fd);
-                    conns[fd] = 0;
-                }
+// "rate[:burst]"; the burst defaults to one second's worth.
+static int parse_rate(const char *arg, unsigned *rate, unsigned *burst)
+{
+    char *end;
+    *rate = strtoul(arg, &end, 10);
+    *burst = *end == ':' ? strtoul(end + 1, &end, 10) : *rate;
+    if (*end || (*rate && !*burst))
+        return -1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    raise_nofile();
+    // Held off until the server is up and can upgrade.
+    sigset_t usr2;
+    sigemptyset(&usr2);
+    sigaddset(&usr2, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &usr2, NULL);
+    // getopt() may reorder argv, and -s cuts its argument short.
+    server_argv = calloc(argc + 1, sizeof(char *));
+    for (int i = 0; i < argc; i++)
+        server_argv[i] = strdup(argv[i]);
+    int link = upgrade_inherited();
+
+    const char *log_dir = "chatlog";
+    char *stats_file = NULL;
+    int stats_every = 10;
+    const char *unix_path = NULL;
+    int level = LOG_INFO;
+    int relay_port = 0;
+    char **relay_peers = NULL;
+    int nrelay_peers = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:B:c:d:f:F:H:i:k:l:L:M:p:r:R:s:t:T:u:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (strcmp(optarg, "epoll") == 0)
+                backend = BACKEND_EPOLL;
+            else if (strcmp(optarg, "uring") == 0)
+                backend = BACKEND_URING;
+            else
+                goto usage;
+            break;
+        case 'B':
+            if (parse_rate(optarg, &byte_rate, &byte_burst) < 0)
+                goto usage;
+            break;
+        case 'c':
+            log_dir = strcmp(optarg, "-") == 0 ? NULL : optarg;
+            break;
+        case 'd':
+            db_file = strcmp(optarg, "-") == 0 ? NULL : optarg;
+            break;
+        case 'f':
+            relay_port = atoi(optarg);
+            if (relay_port <= 0)
+                goto usage;
+            break;
+        case 'F':
+            relay_peers = realloc(relay_peers, sizeof(char *) * (nrelay_peers + 1));
+            relay_peers[nrelay_peers++] = optarg;
+            break;
+        case 'H':
+            sendq_high = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'k':
+            ping_interval = atoi(optarg);
+            break;
+        case 'l':
+            level = log_level_parse(optarg);
+            if (level < LOG_OFF)
+                goto usage;
+            break;
+        case 'L':
+            sendq_low = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            if (parse_rate(optarg, &msg_rate, &msg_burst) < 0)
+                goto usage;
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0)
+                slow_policy = SLOW_DROP_OLDEST;
+            else if (strcmp(optarg, "evict") == 0)
+                slow_policy = SLOW_EVICT;
+            else
+                goto usage;
+            break;
+        case 'r':
+            history_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            history_budget = strtoul(optarg, NULL, 10);
+            break;
+        case 's': {
+            stats_file = optarg;
+            char *colon = strrchr(optarg, ':');
+            if (colon) {
+                *colon = '\0';
+                stats_every = atoi(colon + 1);
             }
+            if (stats_every < 1)
+                goto usage;
+            break;
+        }
+        case 't':
+            nshards = atoi(optarg);
+            break;
+        case 'T':
+            login_timeout = atoi(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        default:
+            goto usage;
         }
-        
-        // Rebuild the descriptor set for select().
-        FD_ZERO(&rfds);
-        FD_SET(server_fd, &rfds);
-        max_fd = server_fd + 1;
-        for (int fd = 0; fd < FD_SETSIZE; fd++) {
-            if (conns[fd]) {
-                FD_SET(fd, &rfds);
-                if (fd + 1 > max_fd)
-                    max_fd = fd + 1;
+    }
+    if (optind >= argc || sendq_low > sendq_high || nshards < 1 || nshards > MAX_SHARDS) {
+usage:
+        printf("usage: %s [-b epoll|uring] [-B rate[:burst]] [-c dir] [-d file] [-f port] [-F host:port] [-H high] [-i secs] [-k secs] [-l level] [-L low] [-M rate[:burst]] [-p drop|evict] [-r bytes] [-R bytes] [-s file[:secs]] [-t threads] [-T secs] [-u path] <port>\n", argv[0]);
+        printf("  -b  I/O backend; uring falls back to epoll if unsupported (default epoll)\n");
+        printf("  -B  input bytes per second per client, and burst (default unlimited)\n");
+        printf("  -c  chat log directory, '-' to keep no log (default chatlog)\n");
+        printf("  -d  account database, '-' to keep accounts in memory (default accounts.db)\n");
+        printf("  -f  port to accept links from other nodes on (default none)\n");
+        printf("  -F  a node to link to; repeat for each (default none)\n");
+        printf("  -H  send queue bytes at which a client counts as slow (default %zu)\n", sendq_high);
+        printf("  -i  disconnect clients silent this many seconds, 0 never (default %u)\n", idle_timeout);
+        printf("  -k  send a keepalive to clients silent this many seconds, 0 never (default %u)\n", ping_interval);
+        printf("  -l  log level: off, error, warn, info or debug (default info)\n");
+        printf("  -L  bytes left queued after dropping old messages (default %zu)\n", sendq_low);
+        printf("  -M  input lines per second per client, and burst (default unlimited)\n");
+        printf("  -p  slow client policy: drop oldest messages or evict (default drop)\n");
+        printf("  -r  bytes of recent messages kept per room, 0 for none (default %zu)\n", history_size);
+        printf("  -R  bytes of recent messages kept in all rooms together; past it, new rooms\n"
+               "      keep none (default %zu)\n", history_budget);
+        printf("  -s  write /stats to file every secs seconds (default every 10)\n");
+        printf("  -t  event loop threads, each with its own listener (default 1, at most %d)\n", MAX_SHARDS);
+        printf("  -T  seconds a client gets to log in, 0 for no limit (default %u)\n", login_timeout);
+        printf("  -u  Unix socket to accept local clients on too; they may /tap (default none)\n");
+        exit(1);
+    }
+    int port = atoi(argv[optind]);
+    if (port <= 0) {
+        printf("'%s' not a valid port number\n", argv[optind]);
+        exit(1);
+    }
+    if (log_init(level) < 0) {
+        perror("log_init");
+        exit(1);
+    }
+    if (init_db(db_file) < 0)
+        exit(1);
+    rooms_init(history_size, history_budget);
+    if (log_dir && chatlog_open(log_dir) < 0)
+        exit(1);
+    if (stats_file && metrics_dump_start(stats_file, stats_every) < 0) {
+        perror("metrics_dump_start");
+        exit(1);
+    }
+
+    // Started by an upgrade: the old process's listeners come first.
+    int *passed = NULL;
+    struct upgrade_head head = {0};
+    FILE *state = link >= 0 ? upgrade_receive(link, &passed, &head) : NULL;
+
+    // The old process's Unix socket is kept if it is still at unix_path.
+    int unix_fd = -1;
+    if (head.nunix) {
+        struct sockaddr_un sun;
+        socklen_t len = sizeof(sun);
+        unix_fd = passed[1 + head.nlisten];
+        if (!unix_path || getsockname(unix_fd, (struct sockaddr *) &sun, &len) < 0 ||
+            strncmp(sun.sun_path, unix_path, sizeof(sun.sun_path)) != 0) {
+            close(unix_fd);
+            unix_fd = -1;
+        }
+    }
+    if (unix_path && unix_fd < 0 && (unix_fd = open_unix_listener(unix_path)) < 0)
+        exit(1);
+
+    shards = calloc(nshards, sizeof(*shards));
+    for (int i = 0; i < nshards; i++) {
+        int listen_fd = i < head.nlisten ? passed[1 + i] : open_listener(port);
+        if (listen_fd < 0 || shard_init(&shards[i], i, listen_fd, i == 0 ? unix_fd : -1) < 0)
+            exit(1);
+    }
+    // With fewer shards than before, whatever waits in the rest is lost.
+    for (int i = nshards; i < head.nlisten; i++)
+        close(passed[1 + i]);
+    log_info("listening on port %d with %d %s shard(s)", port, nshards,
+           backend == BACKEND_URING ? "io_uring" : "epoll");
+    if (unix_path)
+        log_info("listening on %s", unix_path);
+    if (state) {
+        upgrade_restore(link, state, passed, &head);
+        free(passed);
+    }
+    if ((relay_port || nrelay_peers) &&
+        relay_start(relay_port, relay_peers, nrelay_peers, deliver_remote) < 0)
+        exit(1);
+
+    struct sigaction sa = {.sa_handler = on_sigusr2, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &usr2, NULL);
+
+    for (;;) {
+        // Shard 0 runs on the main thread.
+        for (int i = 1; i < nshards; i++) {
+            if (pthread_create(&shards[i].thread, NULL, shard_loop, &shards[i]) != 0) {
+                perror("pthread_create");
+                exit(1);
             }
         }
+        shard_loop(&shards[0]);
+
+        // Only an upgrade stops the loops.
+        for (int i = 1; i < nshards; i++)
+            pthread_join(shards[i].thread, NULL);
+        if (hand_off() == 0) {
+            log_flush();
+            exit(0);
+        }
+        atomic_store(&upgrade_asked, false);
     }
-    
-    exit(1);
 }
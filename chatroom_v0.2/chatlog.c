@@ -0,0 +1,529 @@
+#define _GNU_SOURCE     // memrchr
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "chatlog.h"
+
+#define STAMP_LEN 19            // "YYYY-mm-dd HH:MM:SS", after the '['
+#define LINE_MAX_BYTES 1200     // room, user and a LINE_MAX_LEN message
+#define PENDING_MAX (16 << 20)  // lines are dropped past this if the disk stalls
+
+struct index_ent {
+    int64_t time;
+    uint64_t off;
+};
+
+struct segment {
+    uint64_t base;      // log offset of the first byte
+    uint64_t size;      // committed bytes
+    int fd;             // kept open for mapping
+    int idx_fd;         // last segment only, else -1
+};
+
+struct seg_map {
+    atomic_uint refcnt;
+    char *data;
+    size_t len;
+    uint64_t base;
+};
+
+static char *log_dir;
+static bool enabled;
+
+// Committed state, read by replays.
+static struct segment *segs;
+static int nsegs;
+static size_t segs_cap;
+static struct index_ent *entries;
+static size_t nentries, entries_cap;
+
+// Filled by chatlog_append(), taken by the writer every commit.
+static char *pending;
+static size_t pending_len, pending_cap;
+static struct index_ent *pending_idx;
+static size_t npending_idx, pending_idx_cap;
+static uint64_t next_off;       // log offset just past the pending lines
+static uint64_t last_indexed;
+static bool any_indexed;
+static size_t dropped;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Grows *buf so it holds n elements of the given size.
+static int reserve(void **buf, size_t *cap, size_t n, size_t size){
+    if (n <= *cap)
+        return 0;
+    size_t new_cap = *cap ? *cap : 64;
+    while (new_cap < n)
+        new_cap *= 2;
+    void *p = realloc(*buf, new_cap * size);
+    if (!p)
+        return -1;
+    *buf = p;
+    *cap = new_cap;
+    return 0;
+}
+
+static void seg_name(char *buf, size_t size, uint64_t base, const char *ext){
+    snprintf(buf, size, "%s/%020llu.%s", log_dir, (unsigned long long) base, ext);
+}
+
+static int write_all(int fd, const void *buf, size_t len){
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Opens (creating if needed) the segment at base as the one appended to.
+static int open_active(uint64_t base, uint64_t size){
+    char path[4096];
+    seg_name(path, sizeof(path), base, "log");
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    seg_name(path, sizeof(path), base, "idx");
+    int idx_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (idx_fd < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (reserve((void **) &segs, &segs_cap, nsegs + 1, sizeof(*segs)) < 0) {
+        pthread_mutex_unlock(&lock);
+        close(fd);
+        close(idx_fd);
+        return -1;
+    }
+    if (nsegs > 0 && segs[nsegs - 1].idx_fd >= 0) {
+        close(segs[nsegs - 1].idx_fd);
+        segs[nsegs - 1].idx_fd = -1;
+    }
+    segs[nsegs++] = (struct segment) {base, size, fd, idx_fd};
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Loads one finished segment, or with last, trims a torn final line from it.
+static int load_segment(uint64_t base, bool last){
+    char path[4096];
+    seg_name(path, sizeof(path), base, "log");
+    int fd = open(path, (last ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+    uint64_t size = st.st_size;
+    if (last && size > 0) {
+        char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        char *nl = memrchr(data, '\n', size);
+        uint64_t good = nl ? (uint64_t) (nl - data + 1) : 0;
+        munmap(data, size);
+        if (good != size && ftruncate(fd, good) < 0)
+            perror(path);
+        size = good;
+    }
+
+    // Index entries past the end (from a torn write) are dropped.
+    seg_name(path, sizeof(path), base, "idx");
+    int idx_fd = open(path, O_RDONLY | O_CLOEXEC);
+    size_t kept = 0;
+    if (idx_fd >= 0) {
+        struct index_ent e;
+        while (read(idx_fd, &e, sizeof(e)) == sizeof(e) && e.off >= base && e.off < base + size) {
+            if (reserve((void **) &entries, &entries_cap, nentries + 1, sizeof(*entries)) < 0)
+                break;
+            entries[nentries++] = e;
+            kept++;
+        }
+        close(idx_fd);
+        if (last && truncate(path, kept * sizeof(struct index_ent)) < 0)
+            perror(path);
+    }
+
+    if (last) {
+        close(fd);
+        return open_active(base, size);
+    }
+    if (reserve((void **) &segs, &segs_cap, nsegs + 1, sizeof(*segs)) < 0)
+        return -1;
+    segs[nsegs++] = (struct segment) {base, size, fd, -1};
+    return 0;
+}
+
+// The writer's half of the double buffer; only touched under commit_lock.
+static char *batch;
+static size_t batch_cap;
+static struct index_ent *batch_idx;
+static size_t batch_idx_cap;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Writes and syncs everything appended so far. Caller holds commit_lock.
+static void commit(void){
+    // Swap buffers; appends go on into the other pair meanwhile.
+    pthread_mutex_lock(&lock);
+    char *buf = pending;
+    size_t len = pending_len, cap = pending_cap;
+    pending = batch;
+    pending_cap = batch_cap;
+    pending_len = 0;
+    batch = buf;
+    batch_cap = cap;
+    struct index_ent *idx = pending_idx;
+    size_t nidx = npending_idx, idx_cap = pending_idx_cap;
+    pending_idx = batch_idx;
+    pending_idx_cap = batch_idx_cap;
+    npending_idx = 0;
+    batch_idx = idx;
+    batch_idx_cap = idx_cap;
+    struct segment seg = segs[nsegs - 1];
+    if (dropped) {
+        fprintf(stderr, "chat log: dropped %zu line(s), disk too slow\n", dropped);
+        dropped = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    if (len == 0)
+        return;
+
+    // The group commit: one write and one sync for everything pending.
+    if (write_all(seg.fd, batch, len) < 0 ||
+        write_all(seg.idx_fd, batch_idx, nidx * sizeof(*batch_idx)) < 0 ||
+        fdatasync(seg.fd) < 0 || fdatasync(seg.idx_fd) < 0) {
+        perror("chat log write");
+        // Those lines are lost. Cut the segment back to what was
+        // committed and leave a gap in the offsets where they were.
+        if (ftruncate(seg.fd, seg.size) < 0)
+            perror("chat log truncate");
+        open_active(seg.base + seg.size + len, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    segs[nsegs - 1].size += len;
+    if (reserve((void **) &entries, &entries_cap, nentries + nidx, sizeof(*entries)) == 0) {
+        memcpy(entries + nentries, batch_idx, nidx * sizeof(*batch_idx));
+        nentries += nidx;
+    }
+    bool roll = segs[nsegs - 1].size >= CHATLOG_SEGMENT_BYTES;
+    pthread_mutex_unlock(&lock);
+    // Batches hold whole lines, so no line ever spans two segments.
+    if (roll)
+        open_active(seg.base + seg.size + len, 0);
+}
+
+static void *writer_thread(void *arg){
+    (void) arg;
+    struct timespec ts = {0, CHATLOG_COMMIT_MS * 1000000L};
+    for (;;) {
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&commit_lock);
+        commit();
+        pthread_mutex_unlock(&commit_lock);
+    }
+    return NULL;
+}
+
+int chatlog_open(const char *dir){
+    log_dir = strdup(dir);
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        return -1;
+    }
+    uint64_t *bases = NULL;
+    size_t nbases = 0, bases_cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        char *end;
+        unsigned long long base = strtoull(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, ".log") != 0)
+            continue;
+        if (reserve((void **) &bases, &bases_cap, nbases + 1, sizeof(*bases)) < 0)
+            break;
+        bases[nbases++] = base;
+    }
+    closedir(d);
+    qsort(bases, nbases, sizeof(*bases), cmp_u64);
+
+    int err = 0;
+    for (size_t i = 0; i < nbases && !err; i++)
+        err = load_segment(bases[i], i == nbases - 1);
+    free(bases);
+    if (!err && nsegs == 0)
+        err = open_active(0, 0);
+    if (err)
+        return -1;
+
+    struct segment *last = &segs[nsegs - 1];
+    next_off = last->base + last->size;
+    any_indexed = nentries > 0;
+    last_indexed = any_indexed ? entries[nentries - 1].off : 0;
+    if (last->size >= CHATLOG_SEGMENT_BYTES && open_active(next_off, 0) < 0)
+        return -1;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, writer_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    enabled = true;
+    return 0;
+}
+
+bool chatlog_enabled(void){
+    return enabled;
+}
+
+void chatlog_flush(void){
+    if (!enabled)
+        return;
+    pthread_mutex_lock(&commit_lock);
+    commit();
+    pthread_mutex_unlock(&commit_lock);
+}
+
+void chatlog_append(const char *room, const char *user, const char *text){
+    if (!enabled)
+        return;
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    char line[LINE_MAX_BYTES];
+    size_t n = strftime(line, sizeof(line), "[%Y-%m-%d %H:%M:%S] ", &tm);
+    n += snprintf(line + n, sizeof(line) - n, "#%s %s: %s\n", room, user, text);
+    if (n >= sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+
+    pthread_mutex_lock(&lock);
+    if (pending_len + n > PENDING_MAX ||
+        reserve((void **) &pending, &pending_cap, pending_len + n, 1) < 0 ||
+        reserve((void **) &pending_idx, &pending_idx_cap, npending_idx + 1, sizeof(*pending_idx)) < 0) {
+        dropped++;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if (!any_indexed || next_off - last_indexed >= CHATLOG_INDEX_EVERY) {
+        pending_idx[npending_idx++] = (struct index_ent) {now, next_off};
+        last_indexed = next_off;
+        any_indexed = true;
+    }
+    memcpy(pending + pending_len, line, n);
+    pending_len += n;
+    next_off += n;
+    pthread_mutex_unlock(&lock);
+}
+
+// First index entry logged at or after t. Caller holds lock.
+static size_t index_lower_bound(time_t t){
+    size_t lo = 0, hi = nentries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].time < t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void format_stamp(char *out, time_t t){
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    memcpy(out, buf, STAMP_LEN);
+    out[STAMP_LEN] = '\0';
+}
+
+int chatlog_seek(struct chatlog_cursor *c, const char *room, time_t from, time_t to){
+    if (!enabled || to <= from || strlen(room) >= sizeof(c->room))
+        return -1;
+    strcpy(c->room, room);
+    format_stamp(c->from, from);
+    format_stamp(c->to, to);
+
+    // The index is sparse: start one entry early and skip lines that are
+    // too old; lines after the entry before the end one may be too new.
+    pthread_mutex_lock(&lock);
+    size_t i = index_lower_bound(from), j = index_lower_bound(to);
+    struct segment *last = &segs[nsegs - 1];
+    c->off = i > 0 ? entries[i - 1].off : segs[0].base;
+    c->end = j < nentries ? entries[j].off : last->base + last->size;
+    c->check_from = j > 0 ? entries[j - 1].off : c->off;
+    pthread_mutex_unlock(&lock);
+
+    c->map = NULL;
+    c->started = false;
+    return c->end > c->off ? 0 : -1;
+}
+
+static void seg_map_put(void *p){
+    struct seg_map *m = p;
+    if (atomic_fetch_sub_explicit(&m->refcnt, 1, memory_order_acq_rel) == 1) {
+        munmap(m->data, m->len);
+        free(m);
+    }
+}
+
+// Maps the committed part of the segment holding c->off, moving c->off up
+// to the next segment if it falls in a gap. Returns -1 past the end.
+static int cursor_map(struct chatlog_cursor *c){
+    if (c->map) {
+        seg_map_put(c->map);
+        c->map = NULL;
+    }
+    pthread_mutex_lock(&lock);
+    int k = 0;
+    while (k < nsegs && segs[k].base + segs[k].size <= c->off)
+        k++;
+    struct segment seg = k < nsegs ? segs[k] : (struct segment) {0, 0, -1, -1};
+    pthread_mutex_unlock(&lock);
+    if (k == nsegs || seg.size == 0)
+        return -1;
+    if (c->off < seg.base)
+        c->off = seg.base;
+
+    struct seg_map *m = malloc(sizeof(*m));
+    if (!m)
+        return -1;
+    m->data = mmap(NULL, seg.size, PROT_READ, MAP_SHARED, seg.fd, 0);
+    if (m->data == MAP_FAILED) {
+        free(m);
+        return -1;
+    }
+    atomic_init(&m->refcnt, 1);
+    m->len = seg.size;
+    m->base = seg.base;
+    c->map = m;
+    return 0;
+}
+
+static size_t next_line(const char *data, size_t p, size_t limit){
+    const char *nl = memchr(data + p, '\n', limit - p);
+    return nl ? (size_t) (nl - data) + 1 : limit;
+}
+
+// Compares the time stamp at the start of a line with a bound.
+static int stamp_cmp(const char *line, const char *bound){
+    return memcmp(line + 1, bound, STAMP_LEN);
+}
+
+// Whether the line at p, ending before end, was said in c's room.
+static bool in_room(const struct chatlog_cursor *c, const char *data, size_t p, size_t end){
+    size_t at = p + STAMP_LEN + 3, len = strlen(c->room);    // past "[stamp] "
+    return end - p > STAMP_LEN + 3 + len + 1 && data[at] == '#' &&
+           memcmp(data + at + 1, c->room, len) == 0 && data[at + 1 + len] == ' ';
+}
+
+struct msgbuf *chatlog_next(struct chatlog_cursor *c, size_t max){
+    for (;;) {
+        if (c->off >= c->end)
+            return NULL;
+        if (!c->map || c->off >= c->map->base + c->map->len) {
+            if (cursor_map(c) < 0) {
+                c->end = c->off;
+                return NULL;
+            }
+            continue;
+        }
+
+        const char *data = c->map->data;
+        uint64_t base = c->map->base;
+        size_t pos = c->off - base;
+        size_t limit = (c->end < base + c->map->len ? c->end : base + c->map->len) - base;
+
+        if (!c->started) {
+            while (pos < limit && stamp_cmp(data + pos, c->from) < 0)
+                pos = next_line(data, pos, limit);
+            c->off = base + pos;
+            if (pos == limit)
+                continue;
+            c->started = true;
+        }
+
+        size_t stop = limit - pos > max ? pos + max : limit;
+        size_t check = c->check_from > base + pos ? c->check_from - base : pos;
+        for (size_t p = check; p < stop; p = next_line(data, p, limit)) {
+            if (stamp_cmp(data + p, c->to) >= 0) {
+                stop = p;
+                c->end = base + p;
+                break;
+            }
+        }
+        // Whole lines only, so live messages queued between two chunks
+        // can't land inside a line.
+        if (stop < limit && data[stop - 1] != '\n') {
+            const char *nl = memrchr(data + pos, '\n', stop - pos);
+            stop = nl ? (size_t) (nl - data) + 1 : next_line(data, stop, limit);
+        }
+        if (c->check_from < base + stop)
+            c->check_from = base + stop;
+        if (stop == pos)
+            return NULL;
+
+        // Send the first run of the room's own lines; the rest of the
+        // chunk waits for the next call.
+        size_t first = pos, last;
+        while (first < stop && !in_room(c, data, first, next_line(data, first, stop)))
+            first = next_line(data, first, stop);
+        for (last = first; last < stop; last = next_line(data, last, stop))
+            if (!in_room(c, data, last, next_line(data, last, stop)))
+                break;
+        if (first == last) {
+            c->off = base + stop;
+            continue;
+        }
+        pos = first;
+        stop = last;
+
+        struct msgbuf *m = msgbuf_borrow((char *) data + pos, stop - pos, seg_map_put, c->map);
+        if (!m)
+            return NULL;
+        atomic_fetch_add_explicit(&c->map->refcnt, 1, memory_order_relaxed);
+        c->off = base + stop;
+        return m;
+    }
+}
+
+void chatlog_cursor_close(struct chatlog_cursor *c){
+    if (c->map)
+        seg_map_put(c->map);
+    c->map = NULL;
+    c->off = c->end;
+}
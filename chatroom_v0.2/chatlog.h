@@ -0,0 +1,61 @@
+#ifndef CHATLOG_H
+#define CHATLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "rooms.h"
+#include "sendq.h"
+
+/* Durable transcript of every room message, one text line each:
+ *
+ *   [2026-10-17 12:00:01] #lobby alice: hi
+ *
+ * Lines go to append-only segment files <dir>/<offset>.log, named by the
+ * byte offset of their first line in the whole log. Each segment has a
+ * sparse index, <offset>.idx, holding the time and offset of a line every
+ * CHATLOG_INDEX_EVERY bytes. Appends only copy into memory; a writer thread
+ * writes and fdatasyncs everything pending every CHATLOG_COMMIT_MS
+ * (group commit), and only committed lines are visible to replay.
+ *
+ * Replay maps segments read-only and hands out msgbufs that point into the
+ * mapping, so the kernel writes straight from the page cache to the socket.
+ * Times are UTC. */
+#define CHATLOG_SEGMENT_BYTES (64 << 20)
+#define CHATLOG_INDEX_EVERY 4096
+#define CHATLOG_COMMIT_MS 50
+
+// Loads (or starts) the log in dir and starts the writer thread.
+int chatlog_open(const char *dir);
+bool chatlog_enabled(void);
+
+// Queues one line for the next commit. Any thread.
+void chatlog_append(const char *room, const char *user, const char *text);
+// Commits what is queued now, without waiting for the writer.
+void chatlog_flush(void);
+
+struct seg_map;
+
+// A position in a replay of one room's lines in [from, to), set up by
+// chatlog_seek().
+struct chatlog_cursor {
+    uint64_t off, end;          // log offsets still to send
+    uint64_t check_from;        // lines past here may be too new
+    struct seg_map *map;        // of the segment being sent, or NULL
+    bool started;               // lines older than from are skipped
+    char from[20], to[20];      // bounds as "YYYY-mm-dd HH:MM:SS"
+    char room[ROOM_NAME_LEN];   // other rooms' lines are skipped
+};
+
+/* Positions c at the lines logged in room in [from, to). Returns -1 if
+ * nothing at all was logged then. */
+int chatlog_seek(struct chatlog_cursor *c, const char *room, time_t from, time_t to);
+
+// The next whole lines of the replay, at most about max bytes, or NULL at
+// the end.
+struct msgbuf *chatlog_next(struct chatlog_cursor *c, size_t max);
+
+void chatlog_cursor_close(struct chatlog_cursor *c);
+
+#endif
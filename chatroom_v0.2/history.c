@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+
+#define AT(h, i) ((h)->data[((h)->head + (i)) % (h)->cap])
+
+struct history *history_new(size_t cap){
+    struct history *h = malloc(sizeof(*h) + cap);
+    if (!h)
+        return NULL;
+    h->cap = cap;
+    h->head = 0;
+    h->len = 0;
+    return h;
+}
+
+// Copies len bytes starting at logical offset from into out.
+static void copy_out(const struct history *h, size_t from, size_t len, char *out){
+    size_t start = (h->head + from) % h->cap;
+    size_t first = h->cap - start < len ? h->cap - start : len;
+    memcpy(out, h->data + start, first);
+    memcpy(out + first, h->data, len - first);
+}
+
+void history_append(struct history *h, const char *msg, size_t len){
+    if (len == 0 || len > h->cap)
+        return;
+    // Drop the oldest messages, whole, until msg fits.
+    while (h->cap - h->len < len) {
+        size_t drop = 0;
+        while (drop < h->len && AT(h, drop) != '\n')
+            drop++;
+        drop = drop < h->len ? drop + 1 : h->len;
+        h->head = (h->head + drop) % h->cap;
+        h->len -= drop;
+    }
+
+    size_t tail = (h->head + h->len) % h->cap;
+    size_t first = h->cap - tail < len ? h->cap - tail : len;
+    memcpy(h->data + tail, msg, first);
+    memcpy(h->data, msg + first, len - first);
+    h->len += len;
+}
+
+struct msgbuf *history_tail(const struct history *h, int n){
+    if (n <= 0 || h->len == 0)
+        return NULL;
+    // Walk back over n newlines; the last byte is the newest message's.
+    size_t start = h->len - 1;
+    while (start > 0) {
+        if (AT(h, start - 1) == '\n' && --n == 0)
+            break;
+        start--;
+    }
+
+    struct msgbuf *m = msgbuf_new(h->len - start);
+    if (!m)
+        return NULL;
+    copy_out(h, start, h->len - start, m->data);
+    m->len = h->len - start;
+    return m;
+}
@@ -0,0 +1,28 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+
+#include "sendq.h"
+
+/* Recent messages of one room, kept as the wire bytes that were sent, in a
+ * byte ring of fixed size. Every message ends in exactly one '\n', so no
+ * index is needed: appending drops whole messages from the front to make
+ * room, and the tail is found by counting newlines back from the end.
+ * Not thread-safe; rooms.c locks around it. */
+struct history {
+    size_t cap;
+    size_t head;    // offset of the oldest byte
+    size_t len;
+    char data[];
+};
+
+struct history *history_new(size_t cap);
+
+// Messages longer than the whole ring are not kept.
+void history_append(struct history *h, const char *msg, size_t len);
+
+// The last n messages as one buffer, or NULL if there are none.
+struct msgbuf *history_tail(const struct history *h, int n);
+
+#endif
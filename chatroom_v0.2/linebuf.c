@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "linebuf.h"
+
+/* Layout: [carried partial, at most LINE_MAX_LEN - 1][READ_CHUNK new bytes][NUL]
+ * New data always lands at the same offset, and the partial line is copied
+ * in just in front of it so the two read as one contiguous run. One per
+ * shard thread. */
+static __thread char scratch[LINE_MAX_LEN + READ_CHUNK + 1];
+
+ssize_t linebuf_read(struct linebuf *lb, int fd, char **start, char **end)
+{
+    char *data = scratch + LINE_MAX_LEN;
+    ssize_t n = read(fd, data, READ_CHUNK);
+    if (n <= 0)
+        return n;
+
+    *start = data - lb->len;
+    *end = data + n;
+    if (lb->len) {
+        memcpy(*start, lb->partial, lb->len);
+        lb->len = 0;
+    }
+    return n;
+}
+
+void linebuf_feed(struct linebuf *lb, const char *data, size_t n, char **start, char **end)
+{
+    char *dst = scratch + LINE_MAX_LEN;
+    memcpy(dst, data, n);
+    *start = dst - lb->len;
+    *end = dst + n;
+    if (lb->len) {
+        memcpy(*start, lb->partial, lb->len);
+        lb->len = 0;
+    }
+}
+
+int linebuf_keep(struct linebuf *lb, const char *start, const char *end)
+{
+    if (!lb->partial && !(lb->partial = malloc(LINE_MAX_LEN)))
+        return -1;
+    memcpy(lb->partial, start, end - start);
+    lb->len = end - start;
+    return 0;
+}
+
+char *linebuf_next(struct linebuf *lb, char **start, char *end)
+{
+    char *line = *start;
+    size_t left = end - line;
+    char *nl = memchr(line, '\n', left);
+
+    if (!nl) {
+        if (left == 0)
+            return NULL;
+        if (left < LINE_MAX_LEN) {
+            // Keep the unterminated tail for the next read.
+            if (linebuf_keep(lb, line, end) == 0)
+                *start = end;
+            return NULL;
+        }
+        // Overlong line: hand out what we have instead of buffering more.
+        nl = end;  // scratch has room for the terminator
+    }
+
+    *nl = '\0';
+    *start = nl < end ? nl + 1 : end;
+    if (nl > line && nl[-1] == '\r')
+        nl[-1] = '\0';
+    return line;
+}
+
+int linebuf_hold(struct linebuf *lb, const char *start, const char *end)
+{
+    size_t n = end - start, rest = lb->held_len - lb->held_off;
+    char *held = malloc(n + rest);
+    if (!held)
+        return -1;
+    memcpy(held, start, n);
+    if (rest)
+        memcpy(held + n, lb->held + lb->held_off, rest);
+    free(lb->held);
+    lb->held = held;
+    lb->held_off = 0;
+    lb->held_len = n + rest;
+    return 0;
+}
+
+int linebuf_stash(struct linebuf *lb, const char *data, size_t n)
+{
+    size_t rest = lb->held_len - lb->held_off;
+    char *held = malloc(rest + n);
+    if (!held)
+        return -1;
+    if (rest)
+        memcpy(held, lb->held + lb->held_off, rest);
+    memcpy(held + rest, data, n);
+    free(lb->held);
+    lb->held = held;
+    lb->held_off = 0;
+    lb->held_len = rest + n;
+    return 0;
+}
+
+bool linebuf_unhold(struct linebuf *lb, char **start, char **end)
+{
+    if (!linebuf_holding(lb))
+        return false;
+    size_t n = lb->held_len - lb->held_off;
+    if (n > READ_CHUNK)
+        n = READ_CHUNK;
+    linebuf_feed(lb, lb->held + lb->held_off, n, start, end);
+    lb->held_off += n;
+    if (lb->held_off == lb->held_len) {
+        free(lb->held);
+        lb->held = NULL;
+        lb->held_off = lb->held_len = 0;
+    }
+    return true;
+}
+
+void linebuf_free(struct linebuf *lb)
+{
+    free(lb->partial);
+    free(lb->held);
+    memset(lb, 0, sizeof(*lb));
+}
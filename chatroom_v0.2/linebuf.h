@@ -0,0 +1,63 @@
+#ifndef LINEBUF_H
+#define LINEBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Longest line carried across reads; an unterminated tail this long is
+// handed out as a line of its own rather than buffered further.
+#define LINE_MAX_LEN 1024
+// Bytes pulled from the socket per read() call.
+#define READ_CHUNK 65536
+
+/* Per-connection input state. Complete lines are split straight out of a
+ * per-thread scratch buffer, so the only thing a connection keeps between reads
+ * is the unterminated tail of the last chunk (allocated on first use), and
+ * input that arrived while it was not being read (see linebuf_hold()). */
+struct linebuf {
+    char *partial;
+    size_t len;
+    char *held;
+    size_t held_off, held_len;
+};
+
+/* Reads as much as one read() will return and prepends the carried partial
+ * line. On success [*start, *end) holds the data to split with
+ * linebuf_next(). Returns the read() result: bytes read, 0 on EOF, or -1. */
+ssize_t linebuf_read(struct linebuf *lb, int fd, char **start, char **end);
+
+/* Same as linebuf_read() for data that already arrived elsewhere (an
+ * io_uring provided buffer); n must not exceed READ_CHUNK. */
+void linebuf_feed(struct linebuf *lb, const char *data, size_t n, char **start, char **end);
+
+/* Returns the next complete line in [*start, end), NUL-terminated with the
+ * trailing "\n" or "\r\n" removed, and advances *start past it. Returns NULL
+ * once no complete line is left, after saving the remainder in lb. */
+char *linebuf_next(struct linebuf *lb, char **start, char *end);
+
+/* Carries [start, end), shorter than LINE_MAX_LEN, over to the front of
+ * the next read; for parsers other than linebuf_next(). Returns -1 if out
+ * of memory. */
+int linebuf_keep(struct linebuf *lb, const char *start, const char *end);
+
+/* Sets [start, end) aside, ahead of anything already held, for a caller
+ * that has stopped taking lines for now. Returns -1 if out of memory. */
+int linebuf_hold(struct linebuf *lb, const char *start, const char *end);
+
+// Sets n more bytes aside behind what is already held.
+int linebuf_stash(struct linebuf *lb, const char *data, size_t n);
+
+// Whether anything is held.
+static inline bool linebuf_holding(const struct linebuf *lb)
+{
+    return lb->held_off < lb->held_len;
+}
+
+/* Like linebuf_feed() with up to READ_CHUNK of the held bytes, oldest
+ * first. Returns false if nothing is held. */
+bool linebuf_unhold(struct linebuf *lb, char **start, char **end);
+
+void linebuf_free(struct linebuf *lb);
+
+#endif
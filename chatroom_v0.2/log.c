@@ -0,0 +1,193 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+#define LOG_SLOTS 8192      // power of two
+#define LOG_TEXT 496        // longer lines are cut short
+#define LOG_IDLE_MS 10      // logger sleep when the ring is empty
+#define LOG_BATCH 65536     // bytes written per write() call
+
+/* Bounded MPMC queue after Vyukov, used with a single consumer. A slot's
+ * seq equals the position that may claim it next; a producer publishes by
+ * setting it to pos + 1, and the consumer frees it by adding LOG_SLOTS. */
+struct slot {
+    atomic_size_t seq;
+    struct timespec when;
+    int level;
+    int len;
+    char text[LOG_TEXT];
+};
+
+int log_level = LOG_INFO;
+
+static struct slot ring[LOG_SLOTS];
+static atomic_size_t head;      // next position to claim
+static size_t tail;             // next position to drain; logger only
+static atomic_size_t written;   // positions before this are out
+static atomic_size_t dropped;
+static atomic_bool running;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+int log_level_parse(const char *name)
+{
+    if (strcmp(name, "off") == 0)
+        return LOG_OFF;
+    for (int i = 0; i <= LOG_DEBUG; i++)
+        if (strcmp(name, level_names[i]) == 0)
+            return i;
+    return -2;
+}
+
+// Errors and warnings go to stderr, the rest to stdout.
+static int level_fd(int level)
+{
+    return level <= LOG_WARN ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+static void write_all(int fd, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return;
+        p += n;
+        len -= n;
+    }
+}
+
+// "HH:MM:SS.mmm LEVEL text\n" into out; localtime is cached per second.
+static size_t format_line(char *out, const struct timespec *when, int level,
+                          const char *text, int len)
+{
+    static time_t cached_sec = -1;
+    static char cached[16];
+    if (when->tv_sec != cached_sec) {
+        struct tm tm;
+        localtime_r(&when->tv_sec, &tm);
+        strftime(cached, sizeof(cached), "%H:%M:%S", &tm);
+        cached_sec = when->tv_sec;
+    }
+    int n = sprintf(out, "%s.%03ld %-5s ", cached, when->tv_nsec / 1000000, level_names[level]);
+    memcpy(out + n, text, len);
+    out[n + len] = '\n';
+    return n + len + 1;
+}
+
+static void *logger_thread(void *arg)
+{
+    (void) arg;
+    static char out[2][LOG_BATCH];  // stdout, stderr
+    size_t out_len[2] = {0, 0};
+    struct timespec idle = {0, LOG_IDLE_MS * 1000000L};
+
+    for (;;) {
+        int drained = 0;
+        for (;;) {
+            struct slot *s = &ring[tail & (LOG_SLOTS - 1)];
+            if (atomic_load_explicit(&s->seq, memory_order_acquire) != tail + 1)
+                break;
+            int b = level_fd(s->level) == STDERR_FILENO;
+            if (out_len[b] + LOG_TEXT + 32 > LOG_BATCH) {
+                write_all(b ? STDERR_FILENO : STDOUT_FILENO, out[b], out_len[b]);
+                out_len[b] = 0;
+            }
+            out_len[b] += format_line(out[b] + out_len[b], &s->when, s->level, s->text, s->len);
+            atomic_store_explicit(&s->seq, tail + LOG_SLOTS, memory_order_release);
+            tail++;
+            drained++;
+        }
+
+        for (int b = 0; b < 2; b++) {
+            if (out_len[b]) {
+                write_all(b ? STDERR_FILENO : STDOUT_FILENO, out[b], out_len[b]);
+                out_len[b] = 0;
+            }
+        }
+        atomic_store_explicit(&written, tail, memory_order_release);
+        size_t lost = atomic_exchange(&dropped, 0);
+        if (lost) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME_COARSE, &now);
+            char text[64], line[128];
+            int len = snprintf(text, sizeof(text), "log ring full, dropped %zu line(s)", lost);
+            write_all(STDERR_FILENO, line, format_line(line, &now, LOG_WARN, text, len));
+        }
+        if (!drained)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+int log_init(int level)
+{
+    log_level = level;
+    for (size_t i = 0; i < LOG_SLOTS; i++)
+        atomic_init(&ring[i].seq, i);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, logger_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    atomic_store(&running, true);
+    return 0;
+}
+
+void log_flush(void)
+{
+    struct timespec wait = {0, 1000000};
+    size_t want = atomic_load(&head);
+    while (atomic_load(&running) && atomic_load_explicit(&written, memory_order_acquire) < want)
+        nanosleep(&wait, NULL);
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+    va_list ap;
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+        char line[LOG_TEXT + 32];
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        char text[LOG_TEXT];
+        va_start(ap, fmt);
+        int len = vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        len = len < 0 ? 0 : len < LOG_TEXT ? len : LOG_TEXT - 1;
+        write_all(level_fd(level), line, format_line(line, &now, level, text, len));
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+    struct slot *s;
+    for (;;) {
+        s = &ring[pos & (LOG_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+
+    // The coarse clock is a vDSO read with no syscall; ms resolution is plenty.
+    clock_gettime(CLOCK_REALTIME_COARSE, &s->when);
+    s->level = level;
+    va_start(ap, fmt);
+    int len = vsnprintf(s->text, LOG_TEXT, fmt, ap);
+    va_end(ap);
+    s->len = len < 0 ? 0 : len < LOG_TEXT ? len : LOG_TEXT - 1;
+    atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+}
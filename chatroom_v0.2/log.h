@@ -0,0 +1,42 @@
+#ifndef LOG_H
+#define LOG_H
+
+/* Server log that never blocks the event loops. A call formats its line
+ * into a slot of a bounded lock-free ring (many producers, one consumer)
+ * and returns; a logger thread formats the time stamps and writes the lines
+ * out in batches. If the ring is full the line is dropped and counted, and
+ * the logger reports the count. Before log_init() lines are written
+ * directly. Lines at or below log_level are kept; LOG_OFF keeps none. */
+enum log_level {
+    LOG_OFF = -1,
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+};
+
+extern int log_level;
+
+// Starts the logger thread.
+int log_init(int level);
+
+// Level from a name such as "info", or -2 if it isn't one.
+int log_level_parse(const char *name);
+
+// Waits until every line logged so far has been written out.
+void log_flush(void);
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Arguments are not evaluated for levels that are filtered out.
+#define log_at(level, ...) \
+    do { \
+        if ((level) <= log_level) \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+#endif
@@ -1,28 +1,39 @@
 #ifndef LOGIN_H
 #define LOGIN_H
 
-#include <stdbool.h>
+#include "userdb.h"
+
+/* Per-connection progress through the Homemenu -> login/create flow.
+ * The event loop feeds one line at a time, so a client that is slow to
+ * answer a prompt never blocks anyone else. */
+enum login_state {
+    LOGIN_HOME,
+    LOGIN_USER,
+    LOGIN_PASS,
+    CREATE_USER,
+    CREATE_CONFIRM,
+    CREATE_PASS,
+    LOGIN_DONE,
+};
+
+struct login_session {
+    enum login_state state;
+    int index;                              // account being logged into
+    char username[MAX_USERNAME_LENGTH];     // name pending confirmation
+};
+
+// login_input() results other than a (non-negative) account index.
+#define LOGIN_PENDING -1
+#define LOGIN_EXIT    -2
 
-#define MAX_USERNAME_LENGTH 15
-#define MAX_PASSWORD_LENGTH 12
-
-
-char* find_username(int index);
 /* These use the socket descriptor
- * to send prompts and receive responses from the client.*/
-int client_loginmenu(int client_fd);
-void client_createmenu(int client_fd);
-int client_Homemenu(int client_fd);
+ * to send prompts to the client; input is fed in by the caller.*/
+void login_start(int client_fd, struct login_session *sess);
+int login_input(int client_fd, struct login_session *sess, const char *line);
 
+// Queues msg for the client; provided by the server's connection layer.
 void client_send(int client_fd, const char *msg);
 
-// Initialize the user database.
-void init_db();
-
-// Account management functions.
-bool create_account(const char* username, const char* password);
-bool del_account(const char* username);
-
 // Sends a welcome banner
 void client_printer(int client_fd);
 
@@ -0,0 +1,46 @@
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "mailbox.h"
+
+int mailbox_init(struct mailbox *mb)
+{
+    atomic_init(&mb->head, NULL);
+    atomic_init(&mb->signalled, false);
+    mb->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return mb->wake_fd < 0 ? -1 : 0;
+}
+
+void mailbox_post(struct mailbox *mb, struct mail *m)
+{
+    struct mail *head = atomic_load_explicit(&mb->head, memory_order_relaxed);
+    do {
+        m->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&mb->head, &head, m,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    if (!atomic_exchange(&mb->signalled, true)) {
+        uint64_t one = 1;
+        // Can only fail once the counter nears 2^64; nothing to do then.
+        (void) !write(mb->wake_fd, &one, sizeof(one));
+    }
+}
+
+struct mail *mailbox_take(struct mailbox *mb)
+{
+    uint64_t n;
+    // EAGAIN just means an earlier take already consumed the wakeup.
+    (void) !read(mb->wake_fd, &n, sizeof(n));
+    // Clear before taking: a post that lands after this will signal again.
+    atomic_store(&mb->signalled, false);
+    struct mail *m = atomic_exchange_explicit(&mb->head, NULL, memory_order_acquire);
+
+    struct mail *fifo = NULL;
+    while (m) {
+        struct mail *next = m->next;
+        m->next = fifo;
+        fifo = m;
+        m = next;
+    }
+    return fifo;
+}
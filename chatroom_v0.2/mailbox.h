@@ -0,0 +1,46 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "rooms.h"
+#include "sendq.h"
+
+/* Lock-free multi-producer, single-consumer inbox for one shard. Any thread
+ * pushes onto an intrusive stack with a compare-and-swap loop. The owner
+ * takes the whole stack in one exchange and reverses it into FIFO order;
+ * nothing is ever popped singly, so there is no ABA problem. An eventfd wakes the owner's event loop, and
+ * is written only when the box goes from idle to signalled, so a burst of
+ * posts costs one wakeup. */
+enum mail_type {
+    MAIL_BROADCAST,     // deliver msg to the room's local members
+    MAIL_DIRECT,        // deliver msg to fd, if it is still account's
+    MAIL_RELAY,         // relay thread: send msg, a frame, to every peer
+    MAIL_PRESENCE,      // relay thread: account's sessions have changed
+};
+
+struct mail {
+    struct mail *next;
+    enum mail_type type;
+    struct room_ref room;   // MAIL_BROADCAST
+    int fd, account, from;  // MAIL_DIRECT: recipient and sending account;
+                            // MAIL_PRESENCE: account
+    struct msgbuf *msg;     // reference owned by the mail; MAIL_PRESENCE has none
+};
+
+struct mailbox {
+    _Atomic(struct mail *) head;
+    atomic_bool signalled;
+    int wake_fd;            // eventfd, readable while mail is pending
+};
+
+int mailbox_init(struct mailbox *mb);
+
+// Posts m (taking ownership) and wakes the owner if needed. Any thread.
+void mailbox_post(struct mailbox *mb, struct mail *m);
+
+// Owner only: clears the wakeup and returns all pending mail, oldest first.
+struct mail *mailbox_take(struct mailbox *mb);
+
+#endif
@@ -0,0 +1,237 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "metrics.h"
+
+#define METRICS_MAX 64      // registered blocks, one per shard
+#define REPORT_MAX 2048
+
+__thread struct stats *stats_self;
+
+static struct stats *blocks[METRICS_MAX];
+static atomic_int nblocks;
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t started;
+
+static unsigned bucket_of(uint64_t v)
+{
+    if (v < (1u << HIST_SUB_BITS))
+        return v;
+    unsigned shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// The largest value that lands in bucket b.
+static uint64_t bucket_top(unsigned b)
+{
+    if (b < (1u << HIST_SUB_BITS))
+        return b;
+    unsigned shift = (b >> HIST_SUB_BITS) - 1;
+    uint64_t sub = b & ((1u << HIST_SUB_BITS) - 1);
+    return (((1ull << HIST_SUB_BITS) + sub) << shift) + (1ull << shift) - 1;
+}
+
+void hist_record(struct hist *h, uint64_t v)
+{
+    stat_add(&h->counts[bucket_of(v)], 1);
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+void metrics_register(struct stats *s)
+{
+    pthread_mutex_lock(&register_lock);
+    int n = atomic_load(&nblocks);
+    if (n == 0)
+        started = metrics_now();
+    if (n < METRICS_MAX) {
+        blocks[n] = s;
+        atomic_store(&nblocks, n + 1);
+        stats_self = s;
+    }
+    pthread_mutex_unlock(&register_lock);
+}
+
+// Plain snapshot of every block added together.
+struct totals {
+    uint64_t msgs_in, msgs_out, bytes_in, bytes_out, dropped, evicted, throttled;
+    uint64_t accepts, closes, syscalls, loops, busy_ns;
+    uint64_t loop_ns[HIST_BUCKETS + 1];     // the last one holds the max
+    uint64_t latency_ns[HIST_BUCKETS + 1];
+    uint64_t queue_bytes[HIST_BUCKETS + 1];
+};
+
+static uint64_t load(stat_t *c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static void sum_hist(uint64_t *out, struct hist *h)
+{
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        out[b] += load(&h->counts[b]);
+    uint64_t max = load(&h->max);
+    if (max > out[HIST_BUCKETS])
+        out[HIST_BUCKETS] = max;
+}
+
+static void sum_all(struct totals *t)
+{
+    memset(t, 0, sizeof(*t));
+    int n = atomic_load(&nblocks);
+    for (int i = 0; i < n; i++) {
+        struct stats *s = blocks[i];
+        t->msgs_in += load(&s->msgs_in);
+        t->msgs_out += load(&s->msgs_out);
+        t->bytes_in += load(&s->bytes_in);
+        t->bytes_out += load(&s->bytes_out);
+        t->dropped += load(&s->dropped);
+        t->evicted += load(&s->evicted);
+        t->throttled += load(&s->throttled);
+        t->accepts += load(&s->accepts);
+        t->closes += load(&s->closes);
+        t->syscalls += load(&s->syscalls);
+        t->loops += load(&s->loops);
+        t->busy_ns += load(&s->busy_ns);
+        sum_hist(t->loop_ns, &s->loop_ns);
+        sum_hist(t->latency_ns, &s->latency_ns);
+        sum_hist(t->queue_bytes, &s->queue_bytes);
+    }
+}
+
+// The value at quantile q (0..1) of a summed histogram.
+static uint64_t percentile(const uint64_t *h, double q)
+{
+    uint64_t total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        total += h[b];
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t) (q * total);
+    if (rank >= total)
+        rank = total - 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h[b];
+        if (seen > rank) {
+            uint64_t v = bucket_top(b);
+            return v < h[HIST_BUCKETS] ? v : h[HIST_BUCKETS];
+        }
+    }
+    return h[HIST_BUCKETS];
+}
+
+static const char *fmt_ns(char *buf, uint64_t ns)
+{
+    if (ns < 1000)
+        sprintf(buf, "%lluns", (unsigned long long) ns);
+    else if (ns < 1000000)
+        sprintf(buf, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        sprintf(buf, "%.1fms", ns / 1e6);
+    else
+        sprintf(buf, "%.2fs", ns / 1e9);
+    return buf;
+}
+
+static const char *fmt_latencies(char *out, size_t size, const uint64_t *h)
+{
+    char a[16], b[16], c[16], d[16], e[16];
+    snprintf(out, size, "p50 %s, p90 %s, p99 %s, p99.9 %s, max %s",
+             fmt_ns(a, percentile(h, 0.5)), fmt_ns(b, percentile(h, 0.9)),
+             fmt_ns(c, percentile(h, 0.99)), fmt_ns(d, percentile(h, 0.999)),
+             fmt_ns(e, h[HIST_BUCKETS]));
+    return out;
+}
+
+static size_t format_report(char *out, size_t size)
+{
+    static __thread struct totals t;    // too big for a shard's stack frame
+    sum_all(&t);
+    uint64_t up = metrics_now() - started;
+    size_t n = 0;
+    char line[128];
+
+#define ADD(...) \
+    do { \
+        int w = snprintf(out + n, size - n, __VA_ARGS__); \
+        if (w > 0) \
+            n = n + w < size ? n + w : size - 1; \
+    } while (0)
+
+    ADD("--- server: up %llus, %d loop(s) ---\n",
+        (unsigned long long) (up / 1000000000), atomic_load(&nblocks));
+    ADD("connections: %llu open, %llu accepted, %llu throttled\n",
+        (unsigned long long) (t.accepts - t.closes), (unsigned long long) t.accepts,
+        (unsigned long long) t.throttled);
+    ADD("messages: %llu in, %llu out, %llu dropped, %llu evicted\n",
+        (unsigned long long) t.msgs_in, (unsigned long long) t.msgs_out,
+        (unsigned long long) t.dropped, (unsigned long long) t.evicted);
+    ADD("bytes: %llu in, %llu out\n",
+        (unsigned long long) t.bytes_in, (unsigned long long) t.bytes_out);
+    ADD("syscalls: %llu, %llu loop iterations, %.1f%% busy\n",
+        (unsigned long long) t.syscalls, (unsigned long long) t.loops,
+        up ? 100.0 * t.busy_ns / up / atomic_load(&nblocks) : 0.0);
+    ADD("loop time: %s\n", fmt_latencies(line, sizeof(line), t.loop_ns));
+    ADD("message latency: %s\n", fmt_latencies(line, sizeof(line), t.latency_ns));
+    ADD("send queue at flush: p50 %lluB, p99 %lluB, max %lluB\n",
+        (unsigned long long) percentile(t.queue_bytes, 0.5),
+        (unsigned long long) percentile(t.queue_bytes, 0.99),
+        (unsigned long long) t.queue_bytes[HIST_BUCKETS]);
+#undef ADD
+    return n;
+}
+
+struct msgbuf *metrics_report(void)
+{
+    struct msgbuf *m = msgbuf_new(REPORT_MAX);
+    if (m)
+        m->len = format_report(m->data, REPORT_MAX);
+    return m;
+}
+
+struct dump {
+    char *path, *tmp;
+    int interval;
+};
+
+static void *dump_thread(void *arg)
+{
+    struct dump *d = arg;
+    char buf[REPORT_MAX];
+    for (;;) {
+        sleep(d->interval);
+        size_t len = format_report(buf, sizeof(buf));
+        FILE *f = fopen(d->tmp, "w");
+        if (!f) {
+            log_warn("stats dump %s: %m", d->tmp);
+            continue;
+        }
+        fwrite(buf, 1, len, f);
+        // Readers always see a whole report.
+        if (fclose(f) != 0 || rename(d->tmp, d->path) < 0)
+            log_warn("stats dump %s: %m", d->path);
+    }
+    return NULL;
+}
+
+int metrics_dump_start(const char *path, int interval)
+{
+    struct dump *d = malloc(sizeof(*d));
+    if (!d)
+        return -1;
+    d->path = strdup(path);
+    d->tmp = malloc(strlen(path) + 5);
+    if (!d->path || !d->tmp)
+        return -1;
+    sprintf(d->tmp, "%s.tmp", path);
+    d->interval = interval;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, dump_thread, d) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "sendq.h"
+
+/* Event-loop instrumentation. Each shard owns one struct stats and is the
+ * only thread that writes it, so counters are bumped with plain relaxed
+ * loads and stores (no locked instructions); /stats and the dump thread
+ * read every shard's block and add them up. Histograms are log-linear in
+ * the HDR style: 8 sub-buckets per power of two, so any value is reported
+ * within 12.5%, in 512 fixed counters. */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef atomic_uint_fast64_t stat_t;
+
+struct hist {
+    stat_t counts[HIST_BUCKETS];
+    stat_t max;
+};
+
+struct stats {
+    stat_t msgs_in;         // lines read from clients
+    stat_t msgs_out;        // messages queued to clients
+    stat_t bytes_in;
+    stat_t bytes_out;
+    stat_t dropped;         // messages dropped from slow clients' queues
+    stat_t evicted;
+    stat_t throttled;       // times a client's reads were paused
+    stat_t accepts;
+    stat_t closes;
+    stat_t syscalls;        // reads, writes, accepts and event waits
+    stat_t loops;
+    stat_t busy_ns;         // time spent handling events, not waiting
+    struct hist loop_ns;    // one event-loop iteration
+    struct hist latency_ns; // message read to its last delivery
+    struct hist queue_bytes;// a send queue's depth when flushed
+};
+
+// The calling thread's block, or NULL on threads that don't keep one.
+extern __thread struct stats *stats_self;
+
+static inline void stat_add(stat_t *c, uint64_t n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+#define STAT_ADD(field, n) \
+    do { \
+        if (stats_self) \
+            stat_add(&stats_self->field, (n)); \
+    } while (0)
+
+void hist_record(struct hist *h, uint64_t v);
+
+#define STAT_RECORD(field, v) \
+    do { \
+        if (stats_self) \
+            hist_record(&stats_self->field, (v)); \
+    } while (0)
+
+static inline uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Makes s the calling thread's block and includes it in reports.
+void metrics_register(struct stats *s);
+
+// The summed report, as sent for /stats.
+struct msgbuf *metrics_report(void);
+
+// Rewrites path with a fresh report every interval seconds.
+int metrics_dump_start(const char *path, int interval);
+
+#endif
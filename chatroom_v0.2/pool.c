@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+// Fills a slab's first POOL_ALIGN bytes; its objects follow.
+struct slab {
+    unsigned live;
+    unsigned dropped;       // pool_trim()'s count of its objects taken off the stack
+};
+
+static struct slab *slab_of(const struct pool *p, void *obj)
+{
+    return (struct slab *) ((size_t) obj & ~(p->slab_bytes - 1));
+}
+
+void pool_init(struct pool *p, size_t size, unsigned per_slab)
+{
+    memset(p, 0, sizeof(*p));
+    p->size = (size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+    p->slab_bytes = POOL_ALIGN;
+    while (p->slab_bytes < POOL_ALIGN + p->size * per_slab)
+        p->slab_bytes *= 2;
+    p->per_slab = (p->slab_bytes - POOL_ALIGN) / p->size;
+}
+
+// Adds a slab, its objects all free.
+static int pool_grow(struct pool *p)
+{
+    // The free stack must hold every object, so pool_put() never fails.
+    unsigned cap = p->live + p->nfree + p->per_slab;
+    if (cap > p->free_cap) {
+        void **stack = realloc(p->free, sizeof(*stack) * cap);
+        if (!stack)
+            return -1;
+        p->free = stack;
+        p->free_cap = cap;
+    }
+    char *slab = aligned_alloc(p->slab_bytes, p->slab_bytes);
+    if (!slab)
+        return -1;
+    memset(slab, 0, sizeof(struct slab));
+    p->empty++;
+    // Pushed last to first, so the slab is handed out in address order.
+    for (unsigned i = p->per_slab; i-- > 0;)
+        p->free[p->nfree++] = slab + POOL_ALIGN + i * p->size;
+    return 0;
+}
+
+void *pool_get(struct pool *p)
+{
+    if (p->nfree == 0 && pool_grow(p) < 0)
+        return NULL;
+    void *obj = p->free[--p->nfree];
+    if (slab_of(p, obj)->live++ == 0)
+        p->empty--;
+    memset(obj, 0, p->size);
+    p->live++;
+    return obj;
+}
+
+void pool_put(struct pool *p, void *obj)
+{
+    p->free[p->nfree++] = obj;
+    if (--slab_of(p, obj)->live == 0)
+        p->empty++;
+    p->live--;
+}
+
+void pool_trim(struct pool *p)
+{
+    if (p->empty <= 1)
+        return;
+    // The empty slab nearest the top of the stack is the warmest to keep.
+    struct slab *keep = NULL;
+    for (unsigned i = p->nfree; i-- > 0 && !keep;)
+        if (slab_of(p, p->free[i])->live == 0)
+            keep = slab_of(p, p->free[i]);
+
+    // Every object of an empty slab is on the stack; the last one off frees it.
+    unsigned n = 0;
+    for (unsigned i = 0; i < p->nfree; i++) {
+        struct slab *s = slab_of(p, p->free[i]);
+        if (s->live || s == keep) {
+            p->free[n++] = p->free[i];
+        } else if (++s->dropped == p->per_slab) {
+            free(s);
+        }
+    }
+    p->nfree = n;
+    p->empty = 1;
+
+    unsigned cap = p->live + p->nfree;
+    void **stack = realloc(p->free, sizeof(*stack) * cap);
+    if (stack) {
+        p->free = stack;
+        p->free_cap = cap;
+    }
+}
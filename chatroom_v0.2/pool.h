@@ -0,0 +1,35 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#define POOL_ALIGN 64       // every object starts on a cache line of its own
+
+/* Fixed-size objects carved out of slabs, for objects that come and go
+ * often, like connections. Freed ones go on a stack to be handed out
+ * again, most recent first, while their memory is still warm. A slab whose
+ * objects are all free goes back to the system at the next pool_trim(),
+ * but for one kept against the next arrival. A pool is not thread-safe;
+ * give each thread its own. */
+struct pool {
+    size_t size;            // of an object, rounded up to POOL_ALIGN
+    size_t slab_bytes;      // a power of two; slabs are aligned to it
+    unsigned per_slab;
+    void **free;
+    unsigned nfree, free_cap;
+    unsigned live;          // handed out and not yet put back
+    unsigned empty;         // slabs with nothing handed out
+};
+
+// per_slab is a minimum; a slab holds as many more as fit its size.
+void pool_init(struct pool *p, size_t size, unsigned per_slab);
+
+/* A zeroed object, or NULL if out of memory. Its memory is left alone
+ * once it is put back, until the next pool_trim(). */
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+
+// Frees all but one of the slabs with nothing handed out.
+void pool_trim(struct pool *p);
+
+#endif
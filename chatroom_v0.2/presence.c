@@ -0,0 +1,260 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "presence.h"
+#include "userdb.h"
+
+static int *members;            // dense list of logged-in fds
+static int count, members_cap;
+
+/* Indexed by fd. A member's slot in members[], its account and shard, and
+ * its neighbours among sessions of the same account. */
+struct member_info {
+    int pos;
+    int account;
+    int shard;
+    int prev, next;
+};
+static struct member_info *info;
+static int info_cap;
+
+// Newest session of each account, or -1; indexed by account.
+static int *account_head;
+static int account_cap;
+
+/* Sessions on other nodes, one entry per node and name: chained by hash
+ * for updates, and dense with swap-remove for rendering. */
+#define REMOTE_BUCKETS 4096
+struct remote {
+    struct remote *next;
+    int node, sessions, pos;
+    char name[MAX_USERNAME_LENGTH + 1];
+};
+static struct remote *remote_bucket[REMOTE_BUCKETS];
+static struct remote **remotes;
+static int nremotes, remotes_cap;
+static int remote_sessions;     // summed over remotes
+
+static struct msgbuf *online_msg;   // cached /online reply, NULL when stale
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Grows *a to hold index i, filling new slots with fill. Returns -1 if out
+// of memory, with *a as it was.
+static int grow_ints(int **a, int *cap, int i, int fill){
+    if (i < *cap)
+        return 0;
+    int new_cap = *cap ? *cap : 64;
+    while (new_cap <= i)
+        new_cap *= 2;
+    int *n = realloc(*a, sizeof(*n) * new_cap);
+    if (!n)
+        return -1;
+    for (int j = *cap; j < new_cap; j++)
+        n[j] = fill;
+    *a = n;
+    *cap = new_cap;
+    return 0;
+}
+
+static void invalidate(void){
+    if (online_msg) {
+        msgbuf_put(online_msg);
+        online_msg = NULL;
+    }
+}
+
+int presence_add(int fd, int account, int shard){
+    pthread_mutex_lock(&lock);
+    if (grow_ints(&members, &members_cap, count, -1) < 0 ||
+        grow_ints(&account_head, &account_cap, account, -1) < 0) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    if (fd >= info_cap) {
+        int new_cap = info_cap ? info_cap : 64;
+        while (new_cap <= fd)
+            new_cap *= 2;
+        struct member_info *n = realloc(info, sizeof(*n) * new_cap);
+        if (!n) {
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+        info = n;
+        info_cap = new_cap;
+    }
+
+    struct member_info *m = &info[fd];
+    m->pos = count;
+    m->account = account;
+    m->shard = shard;
+    m->prev = -1;
+    m->next = account_head[account];
+    if (m->next >= 0)
+        info[m->next].prev = fd;
+    account_head[account] = fd;
+    members[count++] = fd;
+    invalidate();
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void presence_remove(int fd){
+    pthread_mutex_lock(&lock);
+    struct member_info *m = &info[fd];
+
+    int last = members[--count];
+    members[m->pos] = last;
+    info[last].pos = m->pos;
+
+    if (m->prev >= 0)
+        info[m->prev].next = m->next;
+    else
+        account_head[m->account] = m->next;
+    if (m->next >= 0)
+        info[m->next].prev = m->prev;
+    invalidate();
+    pthread_mutex_unlock(&lock);
+}
+
+int presence_count(void){
+    pthread_mutex_lock(&lock);
+    int n = count;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+int presence_find(int account, int *shard){
+    pthread_mutex_lock(&lock);
+    int fd = account >= 0 && account < account_cap ? account_head[account] : -1;
+    if (fd >= 0)
+        *shard = info[fd].shard;
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+int presence_sessions(int account){
+    pthread_mutex_lock(&lock);
+    int n = 0;
+    if (account >= 0 && account < account_cap)
+        for (int fd = account_head[account]; fd >= 0; fd = info[fd].next)
+            n++;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+int presence_accounts(int **accounts){
+    pthread_mutex_lock(&lock);
+    int n = 0;
+    *accounts = malloc(sizeof(int) * (count ? count : 1));
+    if (*accounts) {
+        // An account's newest session stands for it.
+        for (int i = 0; i < count; i++) {
+            struct member_info *m = &info[members[i]];
+            if (account_head[m->account] == members[i])
+                (*accounts)[n++] = m->account;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return *accounts ? n : -1;
+}
+
+static struct remote **remote_slot(int node, const char *name){
+    unsigned h = 2166136261u ^ node;
+    for (const char *c = name; *c; c++)
+        h = (h ^ (unsigned char) *c) * 16777619u;
+    struct remote **p = &remote_bucket[h % REMOTE_BUCKETS];
+    while (*p && ((*p)->node != node || strcmp((*p)->name, name) != 0))
+        p = &(*p)->next;
+    return p;
+}
+
+// Takes the entry at *p out of its chain and the dense array.
+static void remote_free(struct remote **p){
+    struct remote *r = *p;
+    *p = r->next;
+    struct remote *last = remotes[--nremotes];
+    remotes[r->pos] = last;
+    last->pos = r->pos;
+    remote_sessions -= r->sessions;
+    free(r);
+}
+
+void presence_remote(int node, const char *name, int sessions){
+    pthread_mutex_lock(&lock);
+    struct remote **p = remote_slot(node, name);
+    if (*p && sessions > 0) {
+        remote_sessions += sessions - (*p)->sessions;
+        (*p)->sessions = sessions;
+    } else if (*p) {
+        remote_free(p);
+    } else if (sessions > 0) {
+        if (nremotes == remotes_cap) {
+            int cap = remotes_cap ? remotes_cap * 2 : 64;
+            struct remote **a = realloc(remotes, sizeof(*a) * cap);
+            if (!a)
+                goto out;
+            remotes = a;
+            remotes_cap = cap;
+        }
+        struct remote *r = malloc(sizeof(*r));
+        if (!r)
+            goto out;
+        r->next = NULL;
+        r->node = node;
+        r->sessions = sessions;
+        r->pos = nremotes;
+        snprintf(r->name, sizeof(r->name), "%s", name);
+        remotes[nremotes++] = r;
+        remote_sessions += sessions;
+        *p = r;
+    }
+    invalidate();
+out:
+    pthread_mutex_unlock(&lock);
+}
+
+void presence_remote_drop(int node){
+    pthread_mutex_lock(&lock);
+    for (int i = nremotes - 1; i >= 0; i--)
+        if (remotes[i]->node == node)
+            remote_free(remote_slot(node, remotes[i]->name));
+    invalidate();
+    pthread_mutex_unlock(&lock);
+}
+
+static struct msgbuf *render_online(void){
+
+    char header[64];
+    int len = snprintf(header, sizeof(header),
+                       "Current online users (%d user(s)): \n", count + remote_sessions);
+    size_t size = len;
+    for (int i = 0; i < count; i++)
+        size += strlen(find_username(info[members[i]].account)) + 4;
+    for (int i = 0; i < nremotes; i++)
+        size += (strlen(remotes[i]->name) + 4) * remotes[i]->sessions;
+
+    online_msg = msgbuf_new(size + 1);
+    if (!online_msg)
+        return NULL;
+    char *p = online_msg->data;
+    memcpy(p, header, len);
+    p += len;
+    for (int i = 0; i < count; i++)
+        p += sprintf(p, "- %s \n", find_username(info[members[i]].account));
+    for (int i = 0; i < nremotes; i++)
+        for (int n = 0; n < remotes[i]->sessions; n++)
+            p += sprintf(p, "- %s \n", remotes[i]->name);
+    online_msg->len = p - online_msg->data;
+    return online_msg;
+}
+
+struct msgbuf *presence_online_msg(void){
+    pthread_mutex_lock(&lock);
+    struct msgbuf *m = online_msg ? online_msg : render_online();
+    if (m)
+        msgbuf_get(m);
+    pthread_mutex_unlock(&lock);
+    return m;
+}
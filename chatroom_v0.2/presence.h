@@ -0,0 +1,35 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "sendq.h"
+
+/* Who is logged in, across every shard. Members sit in a dense array with
+ * swap-remove, so add and remove are O(1) by fd, and each account chains
+ * its sessions so lookups by account are O(1) too. With federation it also
+ * holds how many sessions each name has on every linked node, which /online
+ * lists alongside. The /online reply is rendered once per membership
+ * change. All calls are thread-safe. */
+// Returns -1 if out of memory, and fd is not added.
+int presence_add(int fd, int account, int shard);
+void presence_remove(int fd);
+
+int presence_count(void);
+// A connection logged in as account (the most recent one), or -1. Its
+// shard is stored in *shard.
+int presence_find(int account, int *shard);
+
+// How many sessions account has logged in here.
+int presence_sessions(int account);
+/* Every account with a session here, once each, into a malloc()ed array.
+ * Returns how many, or -1. */
+int presence_accounts(int **accounts);
+
+// What node last said about name; 0 sessions means it has none left.
+void presence_remote(int node, const char *name, int sessions);
+// Forgets everyone on node, whose link has gone down.
+void presence_remote_drop(int node);
+
+// A new reference to the rendered /online reply; msgbuf_put() it when done.
+struct msgbuf *presence_online_msg(void);
+
+#endif
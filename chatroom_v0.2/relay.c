@@ -0,0 +1,610 @@
+#define _GNU_SOURCE     // accept4
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "linebuf.h"
+#include "log.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "presence.h"
+#include "relay.h"
+#include "rooms.h"
+#include "userdb.h"
+
+/* Wire format. A frame is a 2-byte length and then that many bytes: a type
+ * and its fields. Integers are big-endian; a string is its length (one
+ * byte, or two for a message's text) and its bytes.
+ *
+ *   HELLO     "CHRL", version, node id (8 bytes)
+ *   MESSAGE   color, room, user, text
+ *   PRESENCE  sessions (2 bytes), user
+ *
+ * Each side opens with HELLO and a PRESENCE for every account it has
+ * sessions for. After that a PRESENCE goes out whenever an account's count
+ * changes, carrying the count as it is when sent, so one sent twice does no
+ * harm. Frames of other types are skipped, for later versions. */
+enum { FRAME_HELLO = 1, FRAME_MESSAGE, FRAME_PRESENCE };
+#define MAGIC "CHRL"
+#define VERSION 1
+#define HELLO_LEN (4 + 1 + 8)
+#define FRAME_MAX (1 + 1 + 1 + ROOM_NAME_LEN + 1 + MAX_USERNAME_LENGTH + 2 + LINE_MAX_LEN)
+
+#define MAX_PEERS 64
+#define RETRY_MS 1000
+#define QUEUE_MAX (8 << 20)     // unsent bytes at which a link is given up
+
+// epoll data for what isn't a peer; peers are their index.
+enum { TAG_LISTEN = MAX_PEERS, TAG_WAKE };
+
+struct peer {
+    int fd;                 // -1 while there is no link
+    bool connecting;        // a non-blocking connect() is under way
+    bool up;                // its HELLO has arrived
+    uint64_t node;          // from its HELLO, or 0
+    char name[64];          // host:port, for the log
+    bool dial;              // one of ours to dial (-F), not accepted
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint64_t retry_at;      // ms; UINT64_MAX for never
+    struct sendq out;
+    size_t in_len;
+    unsigned char in[2 + FRAME_MAX];
+};
+
+static struct peer peers[MAX_PEERS];
+static int ndial;           // peers[0..ndial) are dialled, the rest accepted
+static int epfd, listen_fd = -1;
+static struct mailbox inbox;
+static uint64_t node_id;
+static relay_deliver_fn *deliver;
+static pthread_mutex_t deliver_lock = PTHREAD_MUTEX_INITIALIZER;   // held while paused
+static bool enabled;
+
+static uint64_t now_ms(void)
+{
+    return metrics_now() / 1000000;
+}
+
+static unsigned char *put16(unsigned char *p, unsigned v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+// Appends at most max bytes of s after their length, in lenbytes bytes.
+static unsigned char *put_str(unsigned char *p, const char *s, size_t max, int lenbytes)
+{
+    size_t n = strnlen(s, max);
+    if (lenbytes == 2)
+        p = put16(p, n);
+    else
+        *p++ = n;
+    memcpy(p, s, n);
+    return p + n;
+}
+
+static struct msgbuf *frame(int type, const unsigned char *body, size_t len)
+{
+    struct msgbuf *m = msgbuf_new(3 + len);
+    if (!m)
+        return NULL;
+    unsigned char *p = (unsigned char *) m->data;
+    put16(p, 1 + len);
+    p[2] = type;
+    memcpy(p + 3, body, len);
+    m->len = 3 + len;
+    return m;
+}
+
+// Reads fields off a frame; bad is set by any that runs past its end.
+struct reader {
+    const unsigned char *p, *end;
+    bool bad;
+};
+
+static unsigned get8(struct reader *r)
+{
+    if (r->end - r->p < 1) {
+        r->bad = true;
+        return 0;
+    }
+    return *r->p++;
+}
+
+static unsigned get16(struct reader *r)
+{
+    unsigned hi = get8(r);
+    return hi << 8 | get8(r);
+}
+
+// Copies a string of fewer than size bytes into buf, terminated.
+static void get_str(struct reader *r, char *buf, size_t size, int lenbytes)
+{
+    size_t n = lenbytes == 2 ? get16(r) : get8(r);
+    if (r->bad || n >= size || (size_t) (r->end - r->p) < n) {
+        r->bad = true;
+        buf[0] = '\0';
+        return;
+    }
+    memcpy(buf, r->p, n);
+    buf[n] = '\0';
+    r->p += n;
+}
+
+static struct msgbuf *presence_frame(int account)
+{
+    unsigned char body[3 + MAX_USERNAME_LENGTH];
+    int n = presence_sessions(account);
+    unsigned char *b = put16(body, n < 0xffff ? n : 0xffff);
+    b = put_str(b, find_username(account), MAX_USERNAME_LENGTH, 1);
+    return frame(FRAME_PRESENCE, body, b - body);
+}
+
+static void peer_close(struct peer *p, const char *why)
+{
+    if (p->up) {
+        log_info("relay: link with %s down: %s", p->name, why);
+        presence_remote_drop(p - peers);
+    } else {
+        log_debug("relay: %s: %s", p->name, why);
+    }
+    close(p->fd);   // also drops it from the epoll set
+    p->fd = -1;
+    p->connecting = false;
+    p->up = false;
+    p->in_len = 0;
+    sendq_clear(&p->out);
+    if (p->dial)
+        p->retry_at = now_ms() + RETRY_MS;
+}
+
+static void peer_push(struct peer *p, struct msgbuf *m)
+{
+    if (sendq_push(&p->out, m) < 0)
+        peer_close(p, "out of memory");
+    else if (p->out.bytes > QUEUE_MAX)
+        peer_close(p, "not keeping up");
+}
+
+// Opens a link with our HELLO and everyone logged in here.
+static void peer_greet(struct peer *p)
+{
+    unsigned char body[HELLO_LEN];
+    memcpy(body, MAGIC, 4);
+    body[4] = VERSION;
+    for (int i = 0; i < 8; i++)
+        body[5 + i] = node_id >> (56 - 8 * i);
+    struct msgbuf *m = frame(FRAME_HELLO, body, sizeof(body));
+    if (!m) {
+        peer_close(p, "out of memory");
+        return;
+    }
+    peer_push(p, m);
+    msgbuf_put(m);
+
+    int *accounts;
+    int n = presence_accounts(&accounts);
+    for (int i = 0; i < n && p->fd >= 0; i++) {
+        if ((m = presence_frame(accounts[i]))) {
+            peer_push(p, m);
+            msgbuf_put(m);
+        }
+    }
+    if (n >= 0)
+        free(accounts);
+}
+
+// Watches a socket that is connected or connecting.
+static void peer_watch(struct peer *p)
+{
+    int on = 1;
+    setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                             .data.u32 = p - peers};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev) < 0)
+        peer_close(p, strerror(errno));
+}
+
+static void peer_dial(struct peer *p)
+{
+    p->fd = socket(p->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p->fd < 0) {
+        log_warn("relay: socket: %s", strerror(errno));
+        p->retry_at = now_ms() + RETRY_MS;
+        return;
+    }
+    if (connect(p->fd, (struct sockaddr *) &p->addr, p->addrlen) < 0 && errno != EINPROGRESS) {
+        peer_close(p, strerror(errno));
+        return;
+    }
+    p->connecting = true;
+    peer_watch(p);
+}
+
+static bool linked(uint64_t node)
+{
+    for (int i = 0; i < MAX_PEERS; i++)
+        if (peers[i].up && peers[i].node == node)
+            return true;
+    return false;
+}
+
+/* Dials each -F peer that is down and due, unless the node is linked the
+ * other way. Returns ms until the next is due, or -1 if none is down. */
+static int dial_due(void)
+{
+    uint64_t now = now_ms();
+    int timeout = -1;
+    for (int i = 0; i < ndial; i++) {
+        struct peer *p = &peers[i];
+        if (p->fd >= 0 || p->retry_at == UINT64_MAX)
+            continue;
+        if (p->node && linked(p->node))
+            p->retry_at = now + RETRY_MS;
+        else if (p->retry_at <= now)
+            peer_dial(p);
+        if (p->fd < 0) {
+            int wait = p->retry_at > now ? (int) (p->retry_at - now) : 0;
+            if (timeout < 0 || wait < timeout)
+                timeout = wait;
+        }
+    }
+    return timeout;
+}
+
+/* Checks a peer's HELLO. When two nodes have dialled each other, both keep
+ * the link that the lower node id dialled, so they agree on which goes. */
+static int hello(struct peer *p, struct reader *r)
+{
+    if (p->up || r->end - r->p != HELLO_LEN || memcmp(r->p, MAGIC, 4) != 0 ||
+        r->p[4] != VERSION) {
+        peer_close(p, "not a chat relay of this version");
+        return -1;
+    }
+    uint64_t node = 0;
+    for (int i = 0; i < 8; i++)
+        node = node << 8 | r->p[5 + i];
+    p->node = node;
+    if (node == node_id) {
+        peer_close(p, "linked to itself");
+        p->retry_at = UINT64_MAX;
+        return -1;
+    }
+    uint64_t keeper = node < node_id ? node : node_id;
+    for (int i = 0; i < MAX_PEERS; i++) {
+        struct peer *q = &peers[i];
+        if (q == p || !q->up || q->node != node)
+            continue;
+        uint64_t p_by = p->dial ? node_id : node, q_by = q->dial ? node_id : node;
+        if (p_by == keeper && q_by != keeper) {
+            peer_close(q, "linked the other way");
+        } else {
+            peer_close(p, "linked the other way");
+            return -1;
+        }
+    }
+    p->up = true;
+    log_info("relay: linked with %s", p->name);
+    return 0;
+}
+
+// Returns -1 if the frame made p close.
+static int handle_frame(struct peer *p, const unsigned char *f, size_t len)
+{
+    struct reader r = {f + 1, f + len, false};
+    if (!p->up && f[0] != FRAME_HELLO) {
+        peer_close(p, "no HELLO");
+        return -1;
+    }
+    switch (f[0]) {
+    case FRAME_HELLO:
+        return hello(p, &r);
+    case FRAME_MESSAGE: {
+        char room[ROOM_NAME_LEN], user[MAX_USERNAME_LENGTH + 1], text[LINE_MAX_LEN + 1];
+        int color = get8(&r);
+        get_str(&r, room, sizeof(room), 1);
+        get_str(&r, user, sizeof(user), 1);
+        get_str(&r, text, sizeof(text), 2);
+        if (r.bad || strchr(text, '\n'))
+            break;
+        pthread_mutex_lock(&deliver_lock);
+        deliver(room, color, user, text);
+        pthread_mutex_unlock(&deliver_lock);
+        return 0;
+    }
+    case FRAME_PRESENCE: {
+        char user[MAX_USERNAME_LENGTH + 1];
+        int sessions = get16(&r);
+        get_str(&r, user, sizeof(user), 1);
+        if (r.bad)
+            break;
+        presence_remote(p - peers, user, sessions);
+        return 0;
+    }
+    default:
+        return 0;
+    }
+    peer_close(p, "bad frame");
+    return -1;
+}
+
+static void peer_read(struct peer *p)
+{
+    for (;;) {
+        ssize_t n = read(p->fd, p->in + p->in_len, sizeof(p->in) - p->in_len);
+        if (n == 0) {
+            peer_close(p, "closed");
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                peer_close(p, strerror(errno));
+            return;
+        }
+        p->in_len += n;
+        // The buffer holds the largest frame, so a full one always parses.
+        size_t off = 0;
+        while (p->in_len - off >= 2) {
+            size_t len = p->in[off] << 8 | p->in[off + 1];
+            if (len == 0 || len > FRAME_MAX) {
+                peer_close(p, "bad frame");
+                return;
+            }
+            if (p->in_len - off < 2 + len)
+                break;
+            if (handle_frame(p, p->in + off + 2, len) < 0)
+                return;
+            off += 2 + len;
+        }
+        memmove(p->in, p->in + off, p->in_len - off);
+        p->in_len -= off;
+    }
+}
+
+static void peer_event(struct peer *p, unsigned events)
+{
+    if (p->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            peer_close(p, strerror(err));
+            return;
+        }
+        if (!(events & EPOLLOUT))
+            return;
+        p->connecting = false;
+        peer_greet(p);
+        if (p->fd < 0)
+            return;
+    }
+    // Output waits for flush_peers(), at the end of the round.
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        peer_read(p);
+}
+
+static void accept_peers(void)
+{
+    for (;;) {
+        struct sockaddr_storage sa;
+        socklen_t salen = sizeof(sa);
+        int fd = accept4(listen_fd, (struct sockaddr *) &sa, &salen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_warn("relay: accept: %s", strerror(errno));
+            return;
+        }
+        struct peer *p = NULL;
+        for (int i = ndial; i < MAX_PEERS && !p; i++)
+            if (peers[i].fd < 0)
+                p = &peers[i];
+        if (!p) {
+            log_warn("relay: more than %d links, refusing one", MAX_PEERS);
+            close(fd);
+            continue;
+        }
+        char host[NI_MAXHOST], port[NI_MAXSERV];
+        if (getnameinfo((struct sockaddr *) &sa, salen, host, sizeof(host), port, sizeof(port),
+                        NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+            strcpy(host, "?"), strcpy(port, "?");
+        snprintf(p->name, sizeof(p->name), "%s:%s", host, port);
+        p->fd = fd;
+        p->node = 0;
+        peer_watch(p);
+        if (p->fd >= 0)
+            peer_greet(p);
+    }
+}
+
+/* Frames from other threads. Presence also goes to links whose HELLO has
+ * not come yet: the snapshot they opened with may be out of date. */
+static void handle_mail(void)
+{
+    struct mail *mail = mailbox_take(&inbox);
+    while (mail) {
+        struct mail *next = mail->next;
+        if (mail->type == MAIL_PRESENCE)
+            mail->msg = presence_frame(mail->account);
+        for (int i = 0; mail->msg && i < MAX_PEERS; i++) {
+            struct peer *p = &peers[i];
+            if (p->fd >= 0 && !p->connecting && (p->up || mail->type == MAIL_PRESENCE))
+                peer_push(p, mail->msg);
+        }
+        if (mail->msg)
+            msgbuf_put(mail->msg);
+        free(mail);
+        mail = next;
+    }
+}
+
+// One gathered write per link with anything queued.
+static void flush_peers(void)
+{
+    for (int i = 0; i < MAX_PEERS; i++) {
+        struct peer *p = &peers[i];
+        if (p->fd >= 0 && !p->connecting && p->out.bytes > 0 && sendq_flush(&p->out, p->fd) < 0)
+            peer_close(p, strerror(errno));
+    }
+}
+
+static void *relay_thread(void *arg)
+{
+    (void) arg;
+    struct epoll_event events[64];
+    for (;;) {
+        int n = epoll_wait(epfd, events, 64, dial_due());
+        for (int i = 0; i < n; i++) {
+            unsigned tag = events[i].data.u32;
+            if (tag == TAG_LISTEN)
+                accept_peers();
+            else if (tag == TAG_WAKE)
+                handle_mail();
+            else if (peers[tag].fd >= 0)
+                peer_event(&peers[tag], events[i].events);
+        }
+        flush_peers();
+    }
+    return NULL;
+}
+
+// Resolves "host:port" for dialling into p.
+static int peer_resolve(struct peer *p, const char *spec)
+{
+    char host[256];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || (size_t) (colon - spec) >= sizeof(host)) {
+        log_error("relay: '%s' is not host:port", spec);
+        return -1;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *res;
+    int err = getaddrinfo(host, colon + 1, &hints, &res);
+    if (err) {
+        log_error("relay: %s: %s", spec, gai_strerror(err));
+        return -1;
+    }
+    memcpy(&p->addr, res->ai_addr, res->ai_addrlen);
+    p->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    p->dial = true;
+    snprintf(p->name, sizeof(p->name), "%s", spec);
+    return 0;
+}
+
+static int open_port(int port)
+{
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        return -1;
+    // SO_REUSEPORT lets the process an upgrade starts listen beside this one.
+    int on = 1;
+    struct sockaddr_in sin = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr = {.s_addr = htonl(INADDR_ANY)},
+    };
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+        bind(listen_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0)
+        return -1;
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.u32 = TAG_LISTEN};
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+}
+
+int relay_start(int port, char **specs, int npeers, relay_deliver_fn *fn)
+{
+    if (npeers > MAX_PEERS) {
+        log_error("relay: at most %d peers", MAX_PEERS);
+        return -1;
+    }
+    for (int i = 0; i < MAX_PEERS; i++)
+        peers[i].fd = -1;
+    for (int i = 0; i < npeers; i++)
+        if (peer_resolve(&peers[i], specs[i]) < 0)
+            return -1;
+    ndial = npeers;
+    deliver = fn;
+    if (getrandom(&node_id, sizeof(node_id), 0) != sizeof(node_id))
+        node_id = metrics_now() ^ (uint64_t) getpid() << 32;
+    node_id |= 1;   // 0 means unknown
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0 || mailbox_init(&inbox) < 0)
+        return -1;
+    struct epoll_event wev = {.events = EPOLLIN | EPOLLET, .data.u32 = TAG_WAKE};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, inbox.wake_fd, &wev) < 0)
+        return -1;
+    if (port && open_port(port) < 0) {
+        log_error("relay: port %d: %s", port, strerror(errno));
+        return -1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, relay_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    enabled = true;
+    log_info("relay: node %016llx, %d peer(s) to dial%s", (unsigned long long) node_id, npeers,
+             port ? ", accepting links" : "");
+    return 0;
+}
+
+static void post(enum mail_type type, struct msgbuf *m, int account)
+{
+    struct mail *mail = malloc(sizeof(*mail));
+    if (!mail) {
+        if (m)
+            msgbuf_put(m);
+        return;
+    }
+    mail->type = type;
+    mail->msg = m;
+    mail->account = account;
+    mailbox_post(&inbox, mail);
+}
+
+void relay_broadcast(const char *room, int color, const char *user, const char *text)
+{
+    if (!enabled)
+        return;
+    unsigned char body[FRAME_MAX], *b = body;
+    *b++ = color;
+    b = put_str(b, room, ROOM_NAME_LEN - 1, 1);
+    b = put_str(b, user, MAX_USERNAME_LENGTH, 1);
+    b = put_str(b, text, LINE_MAX_LEN, 2);
+    struct msgbuf *m = frame(FRAME_MESSAGE, body, b - body);
+    if (m)
+        post(MAIL_RELAY, m, -1);
+}
+
+void relay_presence(int account)
+{
+    if (enabled)
+        post(MAIL_PRESENCE, NULL, account);
+}
+
+void relay_pause(void)
+{
+    pthread_mutex_lock(&deliver_lock);
+}
+
+void relay_resume(void)
+{
+    pthread_mutex_unlock(&deliver_lock);
+}
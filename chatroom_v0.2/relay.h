@@ -0,0 +1,32 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdbool.h>
+
+/* Federation: several servers share their rooms over TCP links. Each pair
+ * of nodes keeps one link, and a message crosses it once, however many of
+ * the other node's clients are in the room; that node hands it to its own
+ * members and forwards it nowhere, so every node must be linked to every
+ * other. Nodes also keep each other told how many sessions each of their
+ * accounts has, which /online lists. A relay thread owns the links; other
+ * threads only queue frames for it. */
+
+// Runs on the relay thread for each room message a peer's client sent.
+typedef void relay_deliver_fn(const char *room, int color, const char *user, const char *text);
+
+/* Accepts links on port (0 for none) and keeps one to each of the npeers
+ * "host:port" strings in peers[], redialling while it is down. Returns -1
+ * if a peer does not resolve or the port can't be listened on. */
+int relay_start(int port, char **peers, int npeers, relay_deliver_fn *deliver);
+
+// Sends a message from a local client to every peer. Any thread.
+void relay_broadcast(const char *room, int color, const char *user, const char *text);
+// Tells every peer how many sessions account has now. Any thread.
+void relay_presence(int account);
+
+/* Holds off deliver, for as long as every caller of it must have stopped;
+ * the relay thread waits in the meantime. */
+void relay_pause(void);
+void relay_resume(void);
+
+#endif
@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+#include "rooms.h"
+
+#define BUCKETS 4096        // name hash chains
+
+/* Slots sit in a fixed array and are reused but never moved, so shard masks
+ * can be read without the lock. An empty room's slot goes on the free list. */
+struct room {
+    char name[ROOM_NAME_LEN];
+    unsigned gen;           // bumped when the room is freed
+    int members;
+    int next;               // hash chain, or next free slot
+    _Atomic uint64_t shards;
+
+    /* Written by every shard that has members talking, so it has a lock of
+     * its own; lock is taken first when both are needed. */
+    pthread_mutex_t history_lock;
+    struct history *history;    // allocated by the first message
+};
+static struct room rooms[ROOM_MAX];
+static int bucket[BUCKETS];
+static int free_head = -1;
+static int used;            // slots ever handed out
+static int live;            // rooms that exist right now
+
+static size_t history_bytes;
+static size_t history_budget;
+static atomic_size_t history_used;  // in rings allocated now
+static struct msgbuf *list_msg;     // cached /rooms reply, NULL when stale
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hash_name(const char *s){
+    unsigned h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h % BUCKETS;
+}
+
+// Printable, no spaces, and short enough to store.
+static bool valid_name(const char *name){
+    size_t len = strlen(name);
+    if (len == 0 || len >= ROOM_NAME_LEN)
+        return false;
+    for (size_t i = 0; i < len; i++)
+        if (name[i] <= ' ' || name[i] == 0x7f)
+            return false;
+    return true;
+}
+
+static void invalidate(void){
+    if (list_msg) {
+        msgbuf_put(list_msg);
+        list_msg = NULL;
+    }
+}
+
+void rooms_init(size_t history_size, size_t budget){
+    history_bytes = history_size;
+    history_budget = budget;
+    for (int i = 0; i < BUCKETS; i++)
+        bucket[i] = -1;
+    for (int i = 0; i < ROOM_MAX; i++)
+        pthread_mutex_init(&rooms[i].history_lock, NULL);
+    // Slot 0; room_leave() never frees it.
+    struct room_ref lobby;
+    room_join(ROOM_LOBBY_NAME, &lobby);
+    room_leave(lobby);
+}
+
+int room_join(const char *name, struct room_ref *ref){
+    if (!valid_name(name))
+        return -1;
+    pthread_mutex_lock(&lock);
+    unsigned h = hash_name(name);
+    int slot = bucket[h];
+    while (slot >= 0 && strcmp(rooms[slot].name, name) != 0)
+        slot = rooms[slot].next;
+
+    if (slot < 0) {
+        if (free_head >= 0) {
+            slot = free_head;
+            free_head = rooms[slot].next;
+        } else if (used < ROOM_MAX) {
+            slot = used++;
+        } else {
+            pthread_mutex_unlock(&lock);
+            return -2;
+        }
+        struct room *r = &rooms[slot];
+        strcpy(r->name, name);
+        r->members = 0;
+        r->next = bucket[h];
+        bucket[h] = slot;
+        live++;
+    }
+    rooms[slot].members++;
+    ref->slot = slot;
+    ref->gen = rooms[slot].gen;
+    invalidate();
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void room_leave(struct room_ref ref){
+    pthread_mutex_lock(&lock);
+    struct room *r = &rooms[ref.slot];
+    if (--r->members == 0 && ref.slot != 0) {
+        int *p = &bucket[hash_name(r->name)];
+        while (*p != ref.slot)
+            p = &rooms[*p].next;
+        *p = r->next;
+        r->next = free_head;
+        free_head = ref.slot;
+        live--;
+
+        pthread_mutex_lock(&r->history_lock);
+        r->gen++;
+        if (r->history)
+            atomic_fetch_sub(&history_used, history_bytes);
+        free(r->history);
+        r->history = NULL;
+        pthread_mutex_unlock(&r->history_lock);
+    }
+    invalidate();
+    pthread_mutex_unlock(&lock);
+}
+
+int room_find(const char *name, struct room_ref *ref){
+    pthread_mutex_lock(&lock);
+    int slot = bucket[hash_name(name)];
+    while (slot >= 0 && strcmp(rooms[slot].name, name) != 0)
+        slot = rooms[slot].next;
+    if (slot >= 0) {
+        ref->slot = slot;
+        ref->gen = rooms[slot].gen;
+    }
+    pthread_mutex_unlock(&lock);
+    return slot < 0 ? -1 : 0;
+}
+
+const char *room_name(int slot){
+    return rooms[slot].name;
+}
+
+int room_members(int slot){
+    pthread_mutex_lock(&lock);
+    int n = rooms[slot].members;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+void room_shard_set(int slot, int shard, bool present){
+    if (present)
+        atomic_fetch_or(&rooms[slot].shards, 1ull << shard);
+    else
+        atomic_fetch_and(&rooms[slot].shards, ~(1ull << shard));
+}
+
+uint64_t room_shards(int slot){
+    return atomic_load_explicit(&rooms[slot].shards, memory_order_relaxed);
+}
+
+// Takes one ring's worth of the budget, if that much is left.
+static bool history_reserve(void){
+    size_t used = atomic_load(&history_used);
+    do {
+        if (history_budget - used < history_bytes)
+            return false;
+    } while (!atomic_compare_exchange_weak(&history_used, &used, used + history_bytes));
+    return true;
+}
+
+void room_record(struct room_ref ref, const char *msg, size_t len){
+    if (history_bytes == 0)
+        return;
+    struct room *r = &rooms[ref.slot];
+    pthread_mutex_lock(&r->history_lock);
+    if (r->gen == ref.gen) {
+        if (!r->history && history_reserve()) {
+            r->history = history_new(history_bytes);
+            if (!r->history)
+                atomic_fetch_sub(&history_used, history_bytes);
+        }
+        if (r->history)
+            history_append(r->history, msg, len);
+    }
+    pthread_mutex_unlock(&r->history_lock);
+}
+
+struct msgbuf *room_history(struct room_ref ref, int n){
+    struct room *r = &rooms[ref.slot];
+    struct msgbuf *m = NULL;
+    pthread_mutex_lock(&r->history_lock);
+    if (r->gen == ref.gen && r->history)
+        m = history_tail(r->history, n);
+    pthread_mutex_unlock(&r->history_lock);
+    return m;
+}
+
+static struct msgbuf *render_list(void){
+    char header[64];
+    int len = snprintf(header, sizeof(header), "Current rooms (%d room(s)): \n", live);
+    size_t size = len;
+    for (int b = 0; b < BUCKETS; b++)
+        for (int s = bucket[b]; s >= 0; s = rooms[s].next)
+            size += strlen(rooms[s].name) + 20;
+
+    list_msg = msgbuf_new(size + 1);
+    if (!list_msg)
+        return NULL;
+    char *p = list_msg->data;
+    memcpy(p, header, len);
+    p += len;
+    for (int b = 0; b < BUCKETS; b++)
+        for (int s = bucket[b]; s >= 0; s = rooms[s].next)
+            p += sprintf(p, "- %s (%d) \n", rooms[s].name, rooms[s].members);
+    list_msg->len = p - list_msg->data;
+    return list_msg;
+}
+
+struct msgbuf *rooms_list_msg(void){
+    pthread_mutex_lock(&lock);
+    struct msgbuf *m = list_msg ? list_msg : render_list();
+    if (m)
+        msgbuf_get(m);
+    pthread_mutex_unlock(&lock);
+    return m;
+}
@@ -0,0 +1,55 @@
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sendq.h"
+
+/* Chat rooms, across every shard. The registry only names rooms and counts
+ * their members; each shard keeps the member array for its own connections
+ * and sets its bit in the room's shard mask while it has any, so a message
+ * costs the room's size, not the server's. A slot's generation changes
+ * whenever it is reused, so mail for a room that has since gone away is
+ * never delivered to its successor. All calls are thread-safe. */
+#define ROOM_NAME_LEN 32
+#define ROOM_MAX 65536
+#define ROOM_MAX_SHARDS 64
+#define ROOM_LOBBY_NAME "lobby"     // where everyone starts; never freed
+
+struct room_ref {
+    int slot;
+    unsigned gen;
+};
+
+/* Each room keeps its last history_size bytes of messages; 0 keeps none.
+ * Rings come out of budget bytes in all, so however many rooms
+ * there are, history never takes more; a room that finds it spent keeps
+ * none until others give theirs back. */
+void rooms_init(size_t history_size, size_t budget);
+
+/* Counts one more member of the room called name, creating it if needed.
+ * Returns -1 if the name is not valid, -2 if there is no room for it. */
+int room_join(const char *name, struct room_ref *ref);
+void room_leave(struct room_ref ref);
+// Looks up the room called name without joining it; -1 if there is none.
+int room_find(const char *name, struct room_ref *ref);
+
+// Stable while the caller is a member.
+const char *room_name(int slot);
+int room_members(int slot);
+
+// Shards a room has local members on, maintained by the shards themselves.
+void room_shard_set(int slot, int shard, bool present);
+uint64_t room_shards(int slot);
+
+// Adds a message, as sent, to the room's history.
+void room_record(struct room_ref ref, const char *msg, size_t len);
+// The room's last n messages as one buffer, or NULL if it has none.
+struct msgbuf *room_history(struct room_ref ref, int n);
+
+// A new reference to the rendered /rooms reply; msgbuf_put() it when done.
+struct msgbuf *rooms_list_msg(void);
+
+#endif
@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "metrics.h"
+#include "sendq.h"
+
+struct msgbuf *msgbuf_new(size_t size)
+{
+    struct msgbuf *m = malloc(sizeof(*m) + size);
+    if (!m)
+        return NULL;
+    atomic_init(&m->refcnt, 1);
+    m->len = 0;
+    m->data = m->bytes;
+    m->release = NULL;
+    m->born = 0;
+    atomic_init(&m->delivered, false);
+    m->kind = 0;
+    m->sender = UINT32_MAX;
+    m->body_off = m->body_len = 0;
+    atomic_init(&m->framed, NULL);
+    return m;
+}
+
+struct msgbuf *msgbuf_from(const char *data, size_t len)
+{
+    struct msgbuf *m = msgbuf_new(len);
+    if (!m)
+        return NULL;
+    memcpy(m->data, data, len);
+    m->len = len;
+    return m;
+}
+
+struct msgbuf *msgbuf_borrow(char *data, size_t len, void (*release)(void *), void *owner)
+{
+    struct msgbuf *m = msgbuf_new(0);
+    if (!m)
+        return NULL;
+    m->data = data;
+    m->len = len;
+    m->release = release;
+    m->owner = owner;
+    return m;
+}
+
+void msgbuf_put(struct msgbuf *m)
+{
+    if (atomic_fetch_sub_explicit(&m->refcnt, 1, memory_order_acq_rel) == 1) {
+        if (m->born && atomic_load_explicit(&m->delivered, memory_order_relaxed))
+            STAT_RECORD(latency_ns, metrics_now() - m->born);
+        if (m->release)
+            m->release(m->owner);
+        struct msgbuf *framed = atomic_load_explicit(&m->framed, memory_order_relaxed);
+        if (framed)
+            msgbuf_put(framed);
+        free(m);
+    }
+}
+
+#define RING_AT(q, i) ((q)->ring[((q)->head + (i)) & ((q)->cap - 1)])
+
+static int grow(struct sendq *q)
+{
+    unsigned cap = q->cap ? q->cap * 2 : 8;
+    struct msgbuf **ring = malloc(sizeof(*ring) * cap);
+    if (!ring)
+        return -1;
+    for (unsigned i = 0; i < q->count; i++)
+        ring[i] = RING_AT(q, i);
+    free(q->ring);
+    q->ring = ring;
+    q->head = 0;
+    q->cap = cap;
+    return 0;
+}
+
+int sendq_push(struct sendq *q, struct msgbuf *m)
+{
+    if (q->count == q->cap && grow(q) < 0)
+        return -1;
+    RING_AT(q, q->count) = msgbuf_get(m);
+    q->count++;
+    q->bytes += m->len;
+    q->pushed++;
+    return 0;
+}
+
+static void pop_head(struct sendq *q)
+{
+    struct msgbuf *m = q->ring[q->head];
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->count--;
+    q->bytes -= m->len - q->off;
+    q->off = 0;
+    msgbuf_put(m);
+}
+
+int sendq_iov(struct sendq *q, struct iovec *iov, struct msgbuf **held, int max)
+{
+    int n_iov = q->count < (unsigned) max ? (int) q->count : max;
+    for (int i = 0; i < n_iov; i++) {
+        struct msgbuf *m = RING_AT(q, i);
+        iov[i].iov_base = m->data;
+        iov[i].iov_len = m->len;
+        if (held)
+            held[i] = msgbuf_get(m);
+    }
+    if (n_iov) {
+        iov[0].iov_base = (char *) iov[0].iov_base + q->off;
+        iov[0].iov_len -= q->off;
+    }
+    return n_iov;
+}
+
+void sendq_consume(struct sendq *q, size_t n)
+{
+    q->sent += n;
+    STAT_ADD(bytes_out, n);
+    // Retire every message that went out in full.
+    while (q->count && n >= RING_AT(q, 0)->len - q->off) {
+        n -= RING_AT(q, 0)->len - q->off;
+        struct msgbuf *m = RING_AT(q, 0);
+        if (!atomic_load_explicit(&m->delivered, memory_order_relaxed))
+            atomic_store_explicit(&m->delivered, true, memory_order_relaxed);
+        pop_head(q);
+    }
+    q->off += n;
+    q->bytes -= n;
+}
+
+int sendq_flush(struct sendq *q, int fd)
+{
+    while (q->count) {
+        struct iovec iov[SENDQ_IOV];
+        struct msghdr msg = {.msg_iov = iov};
+        msg.msg_iovlen = sendq_iov(q, iov, NULL, SENDQ_IOV);
+        size_t want = 0;
+        for (size_t i = 0; i < msg.msg_iovlen; i++)
+            want += iov[i].iov_len;
+
+        // Never blocks, even on a blocking socket, and never raises SIGPIPE.
+        ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        STAT_ADD(syscalls, 1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        sendq_consume(q, n);
+        if ((size_t) n < want)
+            return 0;  // short write: the socket buffer is full
+    }
+    return 0;
+}
+
+void sendq_drop_oldest(struct sendq *q, size_t target)
+{
+    // Keep the message we are halfway through and any an async send holds.
+    unsigned keep = q->off ? 1 : 0;
+    if (keep < q->pinned)
+        keep = q->pinned;
+    unsigned i = keep;
+
+    while (q->bytes > target && i < q->count) {
+        struct msgbuf *m = RING_AT(q, i++);
+        q->bytes -= m->len;
+        q->dropped++;
+        msgbuf_put(m);
+    }
+    // Close the gap: move the kept head up against the survivors.
+    unsigned gone = i - keep;
+    for (unsigned j = keep; gone && j-- > 0;)
+        RING_AT(q, j + gone) = RING_AT(q, j);
+    q->head = (q->head + gone) & (q->cap - 1);
+    q->count -= gone;
+}
+
+void sendq_clear(struct sendq *q)
+{
+    while (q->count)
+        pop_head(q);
+    free(q->ring);
+    memset(q, 0, sizeof(*q));
+}
@@ -0,0 +1,93 @@
+#ifndef SENDQ_H
+#define SENDQ_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* A formatted message shared by every queue it was sent to. A broadcast
+ * builds one msgbuf and each recipient's queue holds a reference, so the
+ * bytes are written by the formatter and never copied again. References
+ * may be taken and dropped from any shard thread. */
+struct msgbuf {
+    atomic_uint refcnt;
+    size_t len;
+    char *data;                     // bytes[] below, or borrowed memory
+    void (*release)(void *owner);   // called when borrowed memory is freed
+    void *owner;
+    uint64_t born;                  // ns when its message was read, or 0
+    atomic_bool delivered;          // written out in full to someone
+    // For binary clients (wire.h): what it is, and the bare text in data.
+    uint8_t kind;                   // enum wire_type; text unless set
+    uint32_t sender;                // account it is from, or UINT32_MAX
+    uint32_t body_off, body_len;    // not used for plain text
+    _Atomic(struct msgbuf *) framed;    // its binary form, once made
+    char bytes[];
+};
+
+// Allocates room for size bytes with one reference held by the caller.
+struct msgbuf *msgbuf_new(size_t size);
+// Copies len bytes of data into a new msgbuf.
+struct msgbuf *msgbuf_from(const char *data, size_t len);
+/* Wraps len bytes that belong to someone else, such as a file mapping,
+ * without copying them. release(owner) runs once the last reference is
+ * dropped. */
+struct msgbuf *msgbuf_borrow(char *data, size_t len, void (*release)(void *), void *owner);
+
+static inline struct msgbuf *msgbuf_get(struct msgbuf *m)
+{
+    atomic_fetch_add_explicit(&m->refcnt, 1, memory_order_relaxed);
+    return m;
+}
+
+/* Drops a reference. A message stamped with born that reached at least one
+ * recipient records its latency when the last reference goes; so does its
+ * binary form, for its own recipients. */
+void msgbuf_put(struct msgbuf *m);
+
+/* Outbound queue of message references for one connection, kept in a ring
+ * that grows by doubling. Whatever the socket could not take is flushed
+ * with a gathered write when it becomes writable again. Messages stay separate so a
+ * slow consumer can lose whole old messages instead of getting a corrupted
+ * stream. */
+struct sendq {
+    struct msgbuf **ring;
+    unsigned head, count, cap;
+    size_t off;         // bytes of the head message already written
+    size_t bytes;       // unsent bytes across all messages
+    size_t dropped;     // messages discarded by sendq_drop_oldest()
+    unsigned pinned;    // head messages an async send is using; never dropped
+    size_t pushed;      // messages ever queued
+    size_t sent;        // bytes ever written
+};
+
+// iovecs gathered per write.
+#define SENDQ_IOV 64
+
+// Queues a new reference to m. Returns -1 if out of memory.
+int sendq_push(struct sendq *q, struct msgbuf *m);
+
+/* Writes queued data with gathered sendmsg() calls until the queue is
+ * empty or the socket would block. Returns 0 on success (including EAGAIN) and -1 on a write
+ * error. */
+int sendq_flush(struct sendq *q, int fd);
+
+/* Points iov at up to max unsent chunks from the head of the queue, for
+ * callers that write asynchronously; with held, also takes a reference to
+ * each message so the bytes outlive the queue. Returns the number filled. */
+int sendq_iov(struct sendq *q, struct iovec *iov, struct msgbuf **held, int max);
+
+// Retires n bytes written from the head of the queue.
+void sendq_consume(struct sendq *q, size_t n);
+
+/* Discards the oldest untouched messages until at most target bytes are
+ * queued. A partially written head and pinned messages are never dropped. */
+void sendq_drop_oldest(struct sendq *q, size_t target);
+
+// Releases every queued reference and the ring itself.
+void sendq_clear(struct sendq *q);
+
+#endif
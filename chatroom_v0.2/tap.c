@@ -0,0 +1,128 @@
+#define _GNU_SOURCE     // memfd_create
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "tap.h"
+
+#define TAP_MIN (64 * 1024)
+#define TAP_MAX (1u << 30)
+
+static int tap_map(struct tap *t, size_t len)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, t->memfd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    t->ring = p;
+    t->data = (char *) p + TAP_DATA;
+    return 0;
+}
+
+int tap_open(struct tap *t, size_t size)
+{
+    uint32_t cap = TAP_MIN;
+    while (cap < size && cap < TAP_MAX)
+        cap *= 2;
+    t->ring = NULL;
+    t->memfd = memfd_create("chat-tap", MFD_CLOEXEC);
+    t->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (t->memfd < 0 || t->eventfd < 0 || ftruncate(t->memfd, TAP_DATA + cap) < 0 ||
+        tap_map(t, TAP_DATA + cap) < 0) {
+        tap_close(t);
+        return -1;
+    }
+    // The file starts out zeroed, indexes and all.
+    t->ring->magic = TAP_MAGIC;
+    t->ring->size = cap;
+    return 0;
+}
+
+int tap_attach(struct tap *t, int memfd, int eventfd)
+{
+    struct stat st;
+    t->ring = NULL;
+    t->memfd = memfd;
+    t->eventfd = eventfd;
+    if (fstat(memfd, &st) < 0 || st.st_size <= TAP_DATA || tap_map(t, st.st_size) < 0 ||
+        t->ring->magic != TAP_MAGIC || TAP_DATA + (off_t) t->ring->size != st.st_size) {
+        tap_close(t);
+        return -1;
+    }
+    return 0;
+}
+
+void tap_close(struct tap *t)
+{
+    if (t->ring)
+        munmap(t->ring, TAP_DATA + t->ring->size);
+    if (t->memfd >= 0)
+        close(t->memfd);
+    if (t->eventfd >= 0)
+        close(t->eventfd);
+    t->ring = NULL;
+    t->memfd = t->eventfd = -1;
+}
+
+int tap_send(struct tap *t, int sock, const char *text, size_t len)
+{
+    int fds[2] = {t->memfd, t->eventfd};
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    struct iovec iov = {(void *) text, len};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf),
+    };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    ssize_t n = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    STAT_ADD(syscalls, 1);
+    return n == (ssize_t) len ? 0 : -1;
+}
+
+bool tap_write(struct tap *t, const char *data, size_t len)
+{
+    struct tap_ring *r = t->ring;
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (len > r->size - (tail - head)) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    size_t at = tail & (r->size - 1);
+    size_t first = len < r->size - at ? len : r->size - at;
+    memcpy(t->data + at, data, first);
+    memcpy(t->data, data + first, len - first);
+    atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+    return true;
+}
+
+size_t tap_queued(const struct tap *t)
+{
+    return atomic_load_explicit(&t->ring->tail, memory_order_relaxed) -
+           atomic_load_explicit(&t->ring->head, memory_order_acquire);
+}
+
+void tap_wake(struct tap *t)
+{
+    // Pairs with the client's fence between setting waiting and reading
+    // tail: one of the two sides sees the other's store.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&t->ring->waiting, memory_order_relaxed) &&
+        atomic_exchange_explicit(&t->ring->waiting, 0, memory_order_relaxed)) {
+        uint64_t one = 1;
+        (void) !write(t->eventfd, &one, sizeof(one));
+        STAT_ADD(syscalls, 1);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef TAP_H
+#define TAP_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A client's output in shared memory instead of its socket, for bots on
+ * the same host (/tap on the Unix socket). The client is handed a memfd
+ * holding a struct tap_ring and, from TAP_DATA on, size bytes of data, and
+ * an eventfd. The data is exactly what the socket would have carried, as a
+ * stream that wraps at size; a message that doesn't fit is dropped whole
+ * and counted. The server is the only writer and the client the only
+ * reader, so each side owns one index and publishes it with a release
+ * store.
+ *
+ * Neither side makes a system call per message. A client that finds the
+ * ring empty sets waiting, checks tail once more, and only then sleeps on
+ * the eventfd; the server writes the eventfd, at most once per loop
+ * iteration, only if waiting was set. */
+#define TAP_MAGIC 0x74617031u   // "tap1"
+#define TAP_DATA 4096           // offset of the data in the memfd
+
+struct tap_ring {
+    uint32_t magic;
+    uint32_t size;                          // of the data; a power of two
+    _Alignas(64) _Atomic uint64_t tail;     // bytes ever written; server
+    _Atomic uint64_t dropped;               // messages lost to a full ring
+    _Alignas(64) _Atomic uint64_t head;     // bytes ever read; client
+    _Atomic uint32_t waiting;               // client: asleep on the eventfd
+};
+
+struct tap {
+    struct tap_ring *ring;
+    char *data;
+    int memfd, eventfd;
+};
+
+// Creates a ring of at least size bytes. Returns -1 on failure.
+int tap_open(struct tap *t, size_t size);
+// Maps the ring another process created, as after an upgrade.
+int tap_attach(struct tap *t, int memfd, int eventfd);
+void tap_close(struct tap *t);
+
+/* Sends len bytes of text over the Unix socket sock with the memfd and
+ * eventfd attached. Returns -1 if the socket would not take it all. */
+int tap_send(struct tap *t, int sock, const char *text, size_t len);
+
+// Copies len bytes in, or returns false and counts a drop if they don't fit.
+bool tap_write(struct tap *t, const char *data, size_t len);
+// Bytes written that the client has yet to read.
+size_t tap_queued(const struct tap *t);
+// Wakes the client if it is waiting for data.
+void tap_wake(struct tap *t);
+
+#endif
@@ -0,0 +1,148 @@
+#include <limits.h>
+#include <string.h>
+#include "timer.h"
+
+#define LEVEL_SHIFT(l) ((l) * TIMER_BITS)
+#define LEVEL_MASK(l) ((1ull << LEVEL_SHIFT(l)) - 1)
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define MAX_TICKS LEVEL_MASK(TIMER_LEVELS)
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now_ms)
+{
+    memset(w, 0, sizeof(*w));
+    w->now = now_ms / TIMER_TICK_MS;
+}
+
+/* Links t into the slot for its expiry, which must be >= w->now. The slot
+ * is next visited no later than the expiry: a level's slot comes round as
+ * the lower levels wrap, and is then cascaded again from scratch. */
+static void place(struct timer_wheel *w, struct timer *t)
+{
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >> LEVEL_SHIFT(level + 1))
+        level++;
+    unsigned slot = (t->expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    struct timer **head = &w->slots[level][slot];
+    t->next = *head;
+    if (*head)
+        (*head)->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    w->occupied[level] |= 1ull << slot;
+}
+
+static void unlink_timer(struct timer_wheel *w, struct timer *t)
+{
+    struct timer **slots = &w->slots[0][0];
+    // The last timer out of a slot clears the slot's bit.
+    if (!t->next && t->pprev >= slots && t->pprev < slots + TIMER_LEVELS * TIMER_SLOTS) {
+        long i = t->pprev - slots;
+        w->occupied[i / TIMER_SLOTS] &= ~(1ull << (i % TIMER_SLOTS));
+    }
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t)
+{
+    if (!t->pprev)
+        return;
+    unlink_timer(w, t);
+    w->count--;
+}
+
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t at_ms)
+{
+    timer_cancel(w, t);
+    // Round up: a timer may fire a little late but never early.
+    uint64_t tick = (at_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (tick < w->now)
+        tick = w->now;
+    if (tick - w->now > MAX_TICKS)
+        tick = w->now + MAX_TICKS;
+    t->expires = tick;
+    place(w, t);
+    w->count++;
+}
+
+// Takes slot's timers off the list, leaving head as a list of its own.
+static struct timer *detach(struct timer_wheel *w, int level, unsigned slot, struct timer **head)
+{
+    *head = w->slots[level][slot];
+    if (*head)
+        (*head)->pprev = head;
+    w->slots[level][slot] = NULL;
+    w->occupied[level] &= ~(1ull << slot);
+    return *head;
+}
+
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now_ms)
+{
+    uint64_t last = now_ms / TIMER_TICK_MS;
+    while (w->now <= last) {
+        if (w->count == 0) {
+            w->now = last + 1;
+            break;
+        }
+        uint64_t tick = w->now;
+        struct timer *list;
+        // Bring the timers of every level that just wrapped down a level,
+        // the highest first so they can fall through several.
+        for (int l = TIMER_LEVELS - 1; l > 0; l--) {
+            if (tick & LEVEL_MASK(l))
+                continue;
+            detach(w, l, (tick >> LEVEL_SHIFT(l)) & SLOT_MASK, &list);
+            while (list) {
+                struct timer *t = list;
+                unlink_timer(w, t);
+                place(w, t);
+            }
+        }
+        // Past this point, re-arming for "now" means the next tick.
+        w->now = tick + 1;
+        detach(w, 0, tick & SLOT_MASK, &list);
+        while (list) {
+            struct timer *t = list;
+            unlink_timer(w, t);
+            w->count--;
+            t->fire(t);     // may cancel others still on list
+        }
+    }
+}
+
+// The tick at which level's nearest occupied slot is next visited.
+static uint64_t next_visit(const struct timer_wheel *w, int level)
+{
+    unsigned cur = (w->now >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    uint64_t bits = w->occupied[level];
+    uint64_t ahead = cur ? bits >> cur | bits << (TIMER_SLOTS - cur) : bits;
+    // A higher level's current slot was already visited unless the wheel
+    // below has just wrapped; then it's next due a whole round later.
+    if (level > 0 && (w->now & LEVEL_MASK(level)))
+        ahead &= ~1ull;
+    unsigned d = ahead ? __builtin_ctzll(ahead) : TIMER_SLOTS;
+    if (level == 0)
+        return w->now + d;
+    return ((w->now >> LEVEL_SHIFT(level)) + d) << LEVEL_SHIFT(level);
+}
+
+int timer_wheel_timeout(const struct timer_wheel *w, uint64_t now_ms)
+{
+    if (w->count == 0)
+        return -1;
+    uint64_t tick = UINT64_MAX;
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        if (!w->occupied[l])
+            continue;
+        uint64_t t = next_visit(w, l);
+        if (t < tick)
+            tick = t;
+    }
+    uint64_t at_ms = tick * TIMER_TICK_MS;
+    if (at_ms <= now_ms)
+        return 0;
+    return at_ms - now_ms > INT_MAX ? INT_MAX : (int) (at_ms - now_ms);
+}
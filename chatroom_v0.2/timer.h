@@ -0,0 +1,57 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hierarchical timer wheel, one per shard and only touched by its thread.
+ * Time moves in TIMER_TICK_MS ticks. Level 0 has a slot per tick for the
+ * next 64 ticks, and each level above has slots 64 times as wide; a timer
+ * sits in the lowest level its distance fits in and moves down a level
+ * each time the wheel below comes round ("cascading"). Arming, re-arming
+ * and cancelling are O(1), and advancing only visits slots that are due.
+ * Timers are embedded in their owner, so there is nothing to allocate. */
+#define TIMER_TICK_MS 100
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4      // 64^4 ticks: about 19 days
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;   // NULL while not armed
+    uint64_t expires;       // tick
+    void (*fire)(struct timer *);   // set by the owner before arming
+};
+
+struct timer_wheel {
+    uint64_t now;           // next tick to run
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t occupied[TIMER_LEVELS];    // a bit per non-empty slot
+    unsigned count;
+};
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now_ms);
+
+// (Re)arms t to fire at or soon after at_ms; later ones are capped.
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t at_ms);
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+
+static inline bool timer_pending(const struct timer *t)
+{
+    return t->pprev != NULL;
+}
+
+// When an armed t is due, in ms.
+static inline uint64_t timer_expiry(const struct timer *t)
+{
+    return t->expires * TIMER_TICK_MS;
+}
+
+// Milliseconds until the wheel next has work, or -1 if it is empty.
+int timer_wheel_timeout(const struct timer_wheel *w, uint64_t now_ms);
+
+/* Runs every tick up to now_ms, calling each expired timer's fire(). The
+ * timer is disarmed first, so fire() may arm it again. */
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE     // posix_spawn_file_actions_addclosefrom_np
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "upgrade.h"
+
+#define BATCH 253       // SCM_MAX_FD: descriptors one message can carry
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+extern char **environ;
+
+// environ with UPGRADE_ENV set to UPGRADE_FD.
+static char **child_env(void)
+{
+    static char var[] = UPGRADE_ENV "=" XSTR(UPGRADE_FD);
+    size_t n = 0;
+    while (environ[n])
+        n++;
+    char **env = malloc(sizeof(*env) * (n + 2));
+    if (!env)
+        return NULL;
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++)
+        if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0)
+            env[k++] = environ[i];
+    env[k++] = var;
+    env[k] = NULL;
+    return env;
+}
+
+int upgrade_spawn(char *const argv[], pid_t *pid)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    // Bounds every send and the wait, should the new process hang.
+    struct timeval tv = {UPGRADE_TIMEOUT_MS / 1000, UPGRADE_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    /* posix_spawn() vforks, so nothing of this process is copied. Every
+     * other descriptor is closed in the child: the connections must only
+     * reach it through the link, or closing them there would not close
+     * them. */
+    char **env = child_env();
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, sv[1], UPGRADE_FD);
+    posix_spawn_file_actions_addclosefrom_np(&fa, UPGRADE_FD + 1);
+    int err = env ? posix_spawnp(pid, argv[0], &fa, NULL, argv, env) : ENOMEM;
+    posix_spawn_file_actions_destroy(&fa);
+    free(env);
+    close(sv[1]);
+    if (err) {
+        close(sv[0]);
+        errno = err;
+        return -1;
+    }
+    return sv[0];
+}
+
+int upgrade_send(int link, const int *fds, int n)
+{
+    if (send(link, &n, sizeof(n), MSG_NOSIGNAL) != sizeof(n))
+        return -1;
+    for (int i = 0; i < n; i += BATCH) {
+        int k = n - i < BATCH ? n - i : BATCH;
+        union {
+            struct cmsghdr h;
+            char buf[CMSG_SPACE(sizeof(int) * BATCH)];
+        } ctl;
+        struct iovec iov = {&k, sizeof(k)};
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = ctl.buf,
+            .msg_controllen = CMSG_SPACE(sizeof(int) * k),
+        };
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * k);
+        memcpy(CMSG_DATA(c), fds + i, sizeof(int) * k);
+        if (sendmsg(link, &msg, MSG_NOSIGNAL) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int upgrade_wait(int link)
+{
+    char ok;
+    return recv(link, &ok, 1, 0) == 1 ? 0 : -1;
+}
+
+int upgrade_inherited(void)
+{
+    const char *v = getenv(UPGRADE_ENV);
+    if (!v)
+        return -1;
+    int link = atoi(v);
+    unsetenv(UPGRADE_ENV);
+    if (fcntl(link, F_SETFD, FD_CLOEXEC) < 0)
+        return -1;
+    return link;
+}
+
+int upgrade_recv(int link, int **fds)
+{
+    int n;
+    if (recv(link, &n, sizeof(n), 0) != sizeof(n) || n < 0)
+        return -1;
+    *fds = malloc(sizeof(int) * (n ? n : 1));
+    if (!*fds)
+        return -1;
+    for (int got = 0; got < n;) {
+        int k;
+        union {
+            struct cmsghdr h;
+            char buf[CMSG_SPACE(sizeof(int) * BATCH)];
+        } ctl;
+        struct iovec iov = {&k, sizeof(k)};
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = ctl.buf,
+            .msg_controllen = sizeof(ctl.buf),
+        };
+        struct cmsghdr *c = NULL;
+        if (recvmsg(link, &msg, 0) == sizeof(k) && !(msg.msg_flags & MSG_CTRUNC))
+            c = CMSG_FIRSTHDR(&msg);
+        if (!c || c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(sizeof(int) * k) ||
+            k > n - got) {
+            free(*fds);
+            return -1;
+        }
+        memcpy(*fds + got, CMSG_DATA(c), sizeof(int) * k);
+        got += k;
+    }
+    return n;
+}
+
+int upgrade_ack(int link)
+{
+    char ok = 1;
+    return send(link, &ok, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
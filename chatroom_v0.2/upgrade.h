@@ -0,0 +1,34 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <sys/types.h>
+
+/* Hot upgrade transport. The running server starts a fresh copy of itself
+ * with one end of a SOCK_SEQPACKET socket pair as fd UPGRADE_FD, named in
+ * the environment, and passes it descriptors with SCM_RIGHTS. What the
+ * descriptors mean is up to the server; the new process answers with one
+ * byte once it has taken them over. */
+#define UPGRADE_ENV "CHAT_UPGRADE_FD"
+#define UPGRADE_FD 3
+#define UPGRADE_TIMEOUT_MS 10000    // for the new process to start and answer
+
+/* Old process: runs argv (searched in PATH like execvp()) with nothing
+ * open but stdio and the link. Returns our end of the link, or -1. */
+int upgrade_spawn(char *const argv[], pid_t *pid);
+
+// Passes n descriptors, in order. Returns -1 if the link broke.
+int upgrade_send(int link, const int *fds, int n);
+
+// Waits for the new process to say it has taken over; -1 if it did not.
+int upgrade_wait(int link);
+
+// New process: the link from the old one, or -1 if started normally.
+int upgrade_inherited(void);
+
+/* Receives the descriptors upgrade_send() passed into a malloc()ed array.
+ * Returns how many, or -1. */
+int upgrade_recv(int link, int **fds);
+
+int upgrade_ack(int link);
+
+#endif
@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+// Waits for the next completion and copies it out.
+static int wait_cqe(struct uring *r, struct io_uring_cqe *out)
+{
+    struct io_uring_cqe *cqe;
+    while (!(cqe = uring_peek(r))) {
+        int ret = sys_enter(r->fd, r->sq_pending, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR)
+            return -1;
+        if (ret >= 0)
+            r->sq_pending = 0;
+    }
+    *out = *cqe;
+    uring_cqe_seen(r);
+    return 0;
+}
+
+/* Whether the ring does everything the server asks of it: each opcode it
+ * uses, by IORING_REGISTER_PROBE, and multishot recv from the buffer ring,
+ * which has no flag to look for, by trying one on a socket pair. Whatever
+ * the kernel version says, a missing piece shows up here, not later. */
+static bool probe(struct uring *r)
+{
+    static const int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_POLL_ADD,
+                              IORING_OP_SENDMSG, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL};
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *pr = calloc(1, len);
+    if (!pr)
+        return false;
+    bool ok = sys_register(r->fd, IORING_REGISTER_PROBE, pr, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+        ok = ops[i] <= pr->last_op && (pr->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    free(pr);
+    if (!ok)
+        return false;
+
+    // The byte goes first, so the first completion never waits.
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return false;
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    if (!sqe || write(sv[1], "", 1) != 1) {
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    uring_prep_recv_multishot(sqe, sv[0]);
+    struct io_uring_cqe cqe;
+    ok = wait_cqe(r, &cqe) == 0 && cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER);
+    if (ok)
+        uring_buf_recycle(r, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    bool more = ok && (cqe.flags & IORING_CQE_F_MORE);
+    // End of stream ends the request; its last completion is the one without F_MORE.
+    close(sv[1]);
+    while (more && wait_cqe(r, &cqe) == 0) {
+        if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+            uring_buf_recycle(r, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            break;
+    }
+    close(sv[0]);
+    return more;
+}
+
+int uring_init(struct uring *r, unsigned entries, unsigned nbufs, unsigned buf_size)
+{
+    // What the fail path undoes, as far as it got.
+    char *ring = MAP_FAILED;
+    size_t ring_size = 0;
+    r->sqes = MAP_FAILED;
+    r->br = NULL;
+    r->bufs = NULL;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 8;  // multishot ops post many CQEs per SQE
+    r->fd = sys_setup(entries, &p);
+    if (r->fd < 0)
+        return -1;
+    // NODROP keeps overflowed completions instead of losing them.
+    if (!(p.features & IORING_FEAT_SUBMIT_STABLE) || !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_SINGLE_MMAP))
+        goto fail;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                r->fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+        goto fail;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sq_head = (unsigned *) (ring + p.sq_off.head);
+    r->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+    r->sq_mask = *(unsigned *) (ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_array = (unsigned *) (ring + p.sq_off.array);
+    r->sq_pending = 0;
+    r->cq_head = (unsigned *) (ring + p.cq_off.head);
+    r->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *) (ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+
+    // Provided buffer ring: nbufs must be a power of two.
+    r->buf_count = nbufs;
+    r->buf_size = buf_size;
+    if (posix_memalign((void **) &r->br, 4096, nbufs * sizeof(struct io_uring_buf)) != 0)
+        goto fail;
+    r->bufs = malloc((size_t) nbufs * buf_size);
+    if (!r->bufs)
+        goto fail;
+    memset(r->br, 0, nbufs * sizeof(struct io_uring_buf));
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (unsigned long) r->br,
+        .ring_entries = nbufs,
+        .bgid = URING_BGID,
+    };
+    if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+    for (unsigned i = 0; i < nbufs; i++)
+        uring_buf_recycle(r, i);
+    if (!probe(r))
+        goto fail;
+    return 0;
+
+fail:
+    free(r->bufs);
+    free(r->br);
+    if (r->sqes != MAP_FAILED)
+        munmap(r->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+    if (ring != MAP_FAILED)
+        munmap(ring, ring_size);
+    close(r->fd);
+    return -1;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned head = atomic_load_explicit((_Atomic unsigned *) r->sq_head, memory_order_acquire);
+    if (tail - head >= r->sq_entries) {
+        // Full: hand what we have to the kernel without waiting.
+        if (sys_enter(r->fd, r->sq_pending, 0, 0) >= 0)
+            r->sq_pending = 0;
+        head = atomic_load_explicit((_Atomic unsigned *) r->sq_head, memory_order_acquire);
+        if (tail - head >= r->sq_entries)
+            return NULL;
+    }
+    unsigned idx = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    atomic_store_explicit((_Atomic unsigned *) r->sq_tail, tail + 1, memory_order_release);
+    r->sq_pending++;
+    return sqe;
+}
+
+int uring_submit_and_wait(struct uring *r)
+{
+    int ret = sys_enter(r->fd, r->sq_pending, 1, IORING_ENTER_GETEVENTS);
+    if (ret >= 0)
+        r->sq_pending = 0;
+    return ret < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *) r->cq_tail, memory_order_acquire);
+    return head == tail ? NULL : &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+    atomic_store_explicit((_Atomic unsigned *) r->cq_head, *r->cq_head + 1, memory_order_release);
+}
+
+char *uring_buf(struct uring *r, unsigned bid)
+{
+    return r->bufs + (size_t) bid * r->buf_size;
+}
+
+void uring_buf_recycle(struct uring *r, unsigned bid)
+{
+    unsigned short tail = r->br->tail;
+    struct io_uring_buf *b = &r->br->bufs[tail & (r->buf_count - 1)];
+    b->addr = (unsigned long) uring_buf(r, bid);
+    b->len = r->buf_size;
+    b->bid = bid;
+    atomic_store_explicit((_Atomic unsigned short *) &r->br->tail, tail + 1,
+                          memory_order_release);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+}
+
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, unsigned flags)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+}
+
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts)
+{
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long) ts;
+    sqe->len = 1;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, __u64 user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+}
@@ -0,0 +1,56 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/* A minimal io_uring wrapper over the raw syscalls: one ring per shard,
+ * plus a ring of provided receive buffers (buffer group URING_BGID) that
+ * multishot recv picks from. */
+#define URING_BGID 0
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending;        // prepared but not yet submitted
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned buf_count, buf_size;
+};
+
+/* Sets up a ring and registers nbufs receive buffers of buf_size bytes.
+ * Returns -1 if the kernel lacks anything the server relies on (multishot
+ * accept and recv, provided buffer rings), so the caller can use epoll. */
+int uring_init(struct uring *r, unsigned entries, unsigned nbufs, unsigned buf_size);
+
+// Next free SQE, zeroed; submits what is queued first if the SQ is full.
+struct io_uring_sqe *uring_sqe(struct uring *r);
+
+// Submits everything prepared and waits for at least one completion.
+int uring_submit_and_wait(struct uring *r);
+
+// Oldest unseen completion or NULL; uring_cqe_seen() consumes it.
+struct io_uring_cqe *uring_peek(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+char *uring_buf(struct uring *r, unsigned bid);
+// Hands a provided buffer back to the kernel once its data is consumed.
+void uring_buf_recycle(struct uring *r, unsigned bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd);
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, unsigned flags);
+// Cancels the request submitted with user_data.
+void uring_prep_cancel(struct io_uring_sqe *sqe, __u64 user_data);
+// Completes with -ETIME after ts, which must last until the next submit.
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts);
+
+#endif
@@ -0,0 +1,645 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "userdb.h"
+
+/* Accounts are fixed-size records packed into pages of ACCT_PAGE records.
+ * The store grows a page at a time into a fixed page directory, so records
+ * never move: find_username() needs no lock and its pointers stay valid.
+ * One allocation covers 4096 accounts instead of two per account. */
+#define ACCT_PAGE_SHIFT 12
+#define ACCT_PAGE (1 << ACCT_PAGE_SHIFT)
+#define ACCT_MAX_PAGES 65536
+
+struct account {
+    char username[MAX_USERNAME_LENGTH];
+    char password[MAX_PASSWORD_LENGTH];
+    uint8_t in_use;
+    uint32_t hash;      // hash_name(username), kept for rehashing
+};
+
+static struct account *pages[ACCT_MAX_PAGES];
+static int npages = 0;
+
+// Serializes everything except find_username() across shard threads.
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+static int size = 0;    // slots handed out so far, live or freed
+
+static struct account *account_at(int index){
+    return &pages[index >> ACCT_PAGE_SHIFT][index & (ACCT_PAGE - 1)];
+}
+
+/* Username -> account index, open addressing with linear probing. Each slot
+ * caches the name's hash so probes only strcmp() on a real candidate. The
+ * table is kept at most half full (tombstones included) so probe runs stay
+ * short. */
+#define SLOT_EMPTY   -1
+#define SLOT_DELETED -2
+
+struct hslot {
+    uint32_t hash;
+    int index;
+};
+
+static struct hslot *htab;
+static unsigned htab_cap = 0;   // power of two
+static unsigned htab_used = 0;  // live entries plus tombstones
+static bool htab_mapped;        // htab points into the snapshot mapping
+
+// Indices released by del_account(), reused before growing the arrays.
+static int *free_idx;
+static int free_count = 0, free_cap = 0;
+
+static uint32_t hash_name(const char *s){
+    uint32_t h = 2166136261u;  // FNV-1a
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+// Returns the slot holding username, or the slot to insert it at (-1 index).
+static struct hslot *htab_probe(const char *username, uint32_t h){
+    struct hslot *tomb = NULL;
+    for (unsigned i = h & (htab_cap - 1);; i = (i + 1) & (htab_cap - 1)) {
+        struct hslot *s = &htab[i];
+        if (s->index == SLOT_EMPTY)
+            return tomb ? tomb : s;
+        if (s->index == SLOT_DELETED) {
+            if (!tomb)
+                tomb = s;
+        } else if (s->hash == h && strcmp(account_at(s->index)->username, username) == 0) {
+            return s;
+        }
+    }
+}
+
+// Returns -1 if out of memory, leaving the table as it was.
+static int htab_resize(unsigned cap){
+    struct hslot *fresh = malloc(sizeof(*fresh) * cap);
+    if (!fresh)
+        return -1;
+    for (unsigned i = 0; i < cap; i++)
+        fresh[i].index = SLOT_EMPTY;
+    unsigned used = 0;
+    for (unsigned i = 0; i < htab_cap; i++) {
+        if (htab[i].index < 0)
+            continue;
+        unsigned j = htab[i].hash & (cap - 1);
+        while (fresh[j].index != SLOT_EMPTY)
+            j = (j + 1) & (cap - 1);
+        fresh[j] = htab[i];
+        used++;
+    }
+    if (!htab_mapped)
+        free(htab);
+    htab_mapped = false;
+    htab = fresh;
+    htab_cap = cap;
+    htab_used = used;
+    return 0;
+}
+
+char* find_username(int index){
+    return account_at(index)->username;
+}
+
+int db_size(){
+    return size;
+}
+
+
+static int expand_db(){
+    if (npages == ACCT_MAX_PAGES)
+        return -1;
+    pages[npages] = calloc(ACCT_PAGE, sizeof(struct account));
+    if (!pages[npages])
+        return -1;
+    npages++;
+    return 0;
+}
+
+/* ===== Persistence =====
+ *
+ * <path> is a snapshot laid out exactly like the in-memory structures:
+ *
+ *   [header, padded to 4 KiB][account pages][hash slots][free indices]
+ *
+ * At startup it is mmap()ed privately and the page directory and hash table
+ * point straight into the mapping, so loading costs a few syscalls and one
+ * pass over the hash table to check it, not a parse. A snapshot that fails
+ * the checks is moved aside to <path>.bad, and whatever journals are still
+ * on disk are replayed from the oldest. Changes since the snapshot live in an
+ * append-only journal, <path>.<gen>.log, of fixed-size checksummed records
+ * that are replayed on top. The event loop only write()s to the journal; a
+ * helper thread fdatasync()s it every JOURNAL_SYNC_MS (group commit).
+ *
+ * Once the journal holds COMPACT_AFTER records, appends move to generation
+ * gen + 1 and a fork()ed child writes a new snapshot from its copy-on-write
+ * view of memory, then renames it over <path>. When the child is reaped the
+ * old journal is deleted. A crash at any point leaves either the old snapshot
+ * plus both journals or the new snapshot plus the new journal. */
+#define DB_MAGIC "CHATDB1"
+#define JOURNAL_SYNC_MS 100
+#define COMPACT_AFTER 16384
+
+struct db_header {
+    char magic[8];
+    uint32_t journal_gen;   // first journal not folded into this snapshot
+    uint32_t size;
+    uint32_t npages;
+    uint32_t htab_cap;
+    uint32_t htab_used;
+    uint32_t free_count;
+    uint64_t pages_off, htab_off, free_off, file_size;
+};
+#define DB_HEADER_SIZE 4096
+
+enum { JOURNAL_CREATE = 1, JOURNAL_DELETE = 2 };
+
+struct journal_rec {
+    uint8_t op;
+    char username[MAX_USERNAME_LENGTH];
+    char password[MAX_PASSWORD_LENGTH];
+    uint32_t check;     // FNV-1a over the bytes above; catches torn appends
+};
+
+static char *db_path;
+static uint32_t journal_gen;
+static int journal_fd = -1;
+static int journal_count;       // records in the current journal
+static bool replaying;
+static uint32_t journal_oldest;  // oldest journal still on disk
+static pid_t compact_pid = -1;
+static uint32_t compact_gen;     // journal_gen of the snapshot being written
+
+/* Guards journal_fd and retired_fd for the sync thread, which syncs its
+ * own duplicate of the fd with the lock released. */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static int retired_fd = -1;     // rotated out, not yet synced and closed
+static atomic_bool journal_dirty;
+static char snapshot_tmp[4096]; // <path>.tmp, made before fork()
+
+static void compact();
+
+static uint32_t rec_check(const struct journal_rec *r){
+    uint32_t h = 2166136261u;
+    const unsigned char *p = (const unsigned char *) r;
+    for (size_t i = 0; i < offsetof(struct journal_rec, check); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static char *journal_name(uint32_t gen){
+    static char name[4096];
+    snprintf(name, sizeof(name), "%s.%u.log", db_path, gen);
+    return name;
+}
+
+static void journal_append(int op, const struct account *a){
+    if (journal_fd < 0 || replaying)
+        return;
+    struct journal_rec r;
+    memset(&r, 0, sizeof(r));
+    r.op = op;
+    memcpy(r.username, a->username, sizeof(r.username));
+    memcpy(r.password, a->password, sizeof(r.password));
+    r.check = rec_check(&r);
+    // Lands in the page cache only; the sync thread makes it durable.
+    if (write(journal_fd, &r, sizeof(r)) != sizeof(r))
+        perror("journal write");
+    atomic_store(&journal_dirty, true);
+    if (++journal_count >= COMPACT_AFTER)
+        compact();
+}
+
+static void *journal_sync_thread(void *arg){
+    (void) arg;
+    struct timespec ts = {0, JOURNAL_SYNC_MS * 1000000L};
+    for (;;) {
+        nanosleep(&ts, NULL);
+        if (!atomic_exchange(&journal_dirty, false))
+            continue;
+        // Only the handover is under the lock: appends and rotation on the
+        // event loop never wait for the disk.
+        pthread_mutex_lock(&journal_lock);
+        int old = retired_fd;
+        retired_fd = -1;
+        int fd = journal_fd >= 0 ? dup(journal_fd) : -1;
+        pthread_mutex_unlock(&journal_lock);
+        if (old >= 0) {
+            fdatasync(old);
+            close(old);
+        }
+        if (fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+// Replays one journal generation. Returns the number of records applied,
+// or -1 if the file doesn't exist.
+static int journal_replay(uint32_t gen){
+    int fd = open(journal_name(gen), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct journal_rec r;
+    off_t good = 0;
+    int count = 0;
+    replaying = true;
+    while (read(fd, &r, sizeof(r)) == sizeof(r) && r.check == rec_check(&r)) {
+        char username[MAX_USERNAME_LENGTH + 1], password[MAX_PASSWORD_LENGTH + 1];
+        memcpy(username, r.username, sizeof(r.username));
+        memcpy(password, r.password, sizeof(r.password));
+        username[sizeof(r.username)] = password[sizeof(r.password)] = '\0';
+        if (r.op == JOURNAL_CREATE)
+            create_account(username, password);
+        else if (r.op == JOURNAL_DELETE)
+            del_account(username);
+        good += sizeof(r);
+        count++;
+    }
+    replaying = false;
+    close(fd);
+    // Drop a torn tail so later appends follow the last good record.
+    if (truncate(journal_name(gen), good) < 0)
+        perror("journal truncate");
+    return count;
+}
+
+static int journal_open(uint32_t gen){
+    int fd = open(journal_name(gen), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror(journal_name(gen));
+        return -1;
+    }
+    pthread_mutex_lock(&journal_lock);
+    // The sync thread makes its last appends durable, then closes it.
+    if (retired_fd >= 0)
+        close(retired_fd);
+    retired_fd = journal_fd;
+    journal_fd = fd;
+    journal_gen = gen;
+    journal_count = 0;
+    pthread_mutex_unlock(&journal_lock);
+    atomic_store(&journal_dirty, true);
+    return 0;
+}
+
+// Whether len bytes at off lie within a file of size bytes.
+static bool in_file(uint64_t off, uint64_t len, uint64_t size){
+    return off <= size && len <= size - off;
+}
+
+/* Whether the header's layout fits the file, and every index it holds
+ * names a slot handed out, so nothing reads or writes past the mapping. */
+static bool snapshot_valid(const char *base, uint64_t file_size){
+    const struct db_header *h = (const struct db_header *) base;
+    if (memcmp(h->magic, DB_MAGIC, sizeof(DB_MAGIC)) != 0 || h->file_size != file_size ||
+        h->npages > ACCT_MAX_PAGES || h->size > (uint64_t) h->npages * ACCT_PAGE ||
+        h->htab_cap == 0 || (h->htab_cap & (h->htab_cap - 1)) != 0 ||
+        h->htab_used >= h->htab_cap || h->free_count > h->size)
+        return false;
+    if (h->pages_off % _Alignof(struct account) || h->htab_off % _Alignof(struct hslot) ||
+        h->free_off % _Alignof(int) ||
+        !in_file(h->pages_off, (uint64_t) h->npages * ACCT_PAGE * sizeof(struct account), file_size) ||
+        !in_file(h->htab_off, (uint64_t) h->htab_cap * sizeof(struct hslot), file_size) ||
+        !in_file(h->free_off, (uint64_t) h->free_count * sizeof(int), file_size))
+        return false;
+
+    const struct account *accts = (const struct account *) (base + h->pages_off);
+    const struct hslot *slots = (const struct hslot *) (base + h->htab_off);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < h->htab_cap; i++) {
+        int index = slots[i].index;
+        if (index == SLOT_EMPTY)
+            continue;
+        used++;
+        if (index != SLOT_DELETED && (index < 0 || (uint32_t) index >= h->size ||
+                                      accts[index].username[MAX_USERNAME_LENGTH - 1] != '\0' ||
+                                      accts[index].password[MAX_PASSWORD_LENGTH - 1] != '\0'))
+            return false;
+    }
+    // Probes end at an empty slot, so there must be one.
+    if (used != h->htab_used)
+        return false;
+    const int *freed = (const int *) (base + h->free_off);
+    for (uint32_t i = 0; i < h->free_count; i++)
+        if (freed[i] < 0 || (uint32_t) freed[i] >= h->size)
+            return false;
+    return true;
+}
+
+// Points the in-memory structures into a snapshot mapping.
+static int snapshot_map(int fd){
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < DB_HEADER_SIZE)
+        return -1;
+    char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    const struct db_header *h = (const struct db_header *) base;
+    int *freed = NULL;
+    if (!snapshot_valid(base, st.st_size) ||
+        !(freed = malloc(sizeof(*freed) * (h->free_count ? h->free_count : 1)))) {
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    // Mapped pages are never freed; pages added later come from calloc().
+    for (uint32_t i = 0; i < h->npages; i++)
+        pages[i] = (struct account *) (base + h->pages_off) + (size_t) i * ACCT_PAGE;
+    npages = h->npages;
+    size = h->size;
+
+    htab = (struct hslot *) (base + h->htab_off);
+    htab_cap = h->htab_cap;
+    htab_used = h->htab_used;
+    htab_mapped = true;
+
+    free_count = free_cap = h->free_count;
+    free_idx = freed;
+    memcpy(free_idx, base + h->free_off, sizeof(*free_idx) * free_count);
+
+    journal_gen = h->journal_gen;
+    return 0;
+}
+
+/* The oldest journal generation next to path, for when the snapshot can't
+ * be used: replaying from there recovers what the journals still hold. */
+static uint32_t journal_first(const char *path){
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    const char *base = slash ? slash + 1 : path;
+    if (slash)
+        *slash = '\0';
+    size_t len = strlen(base);
+    DIR *d = opendir(slash ? (dir[0] ? dir : "/") : ".");
+    if (!d)
+        return 0;
+    uint32_t first = 0;
+    bool found = false;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (strncmp(e->d_name, base, len) != 0 || e->d_name[len] != '.' ||
+            e->d_name[len + 1] < '0' || e->d_name[len + 1] > '9')
+            continue;
+        char *end;
+        unsigned long gen = strtoul(e->d_name + len + 1, &end, 10);
+        if (strcmp(end, ".log") == 0 && gen <= UINT32_MAX && (!found || gen < first)) {
+            first = gen;
+            found = true;
+        }
+    }
+    closedir(d);
+    return first;
+}
+
+static int write_all(int fd, const void *buf, size_t len){
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Writes the current state as a snapshot whose journal starts at gen.
+ * Runs in a child forked from a threaded process, so it calls nothing
+ * but async-signal-safe functions: no stdio, no malloc, no locks. */
+static int snapshot_write(uint32_t gen){
+    const char *tmp = snapshot_tmp;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+
+    char header[DB_HEADER_SIZE] = {0};
+    struct db_header *h = (struct db_header *) header;
+    memcpy(h->magic, DB_MAGIC, sizeof(DB_MAGIC));
+    h->journal_gen = gen;
+    h->size = size;
+    h->npages = npages;
+    h->htab_cap = htab_cap;
+    h->htab_used = htab_used;
+    h->free_count = free_count;
+    h->pages_off = DB_HEADER_SIZE;
+    h->htab_off = h->pages_off + (uint64_t) npages * ACCT_PAGE * sizeof(struct account);
+    h->free_off = h->htab_off + (uint64_t) htab_cap * sizeof(struct hslot);
+    h->file_size = h->free_off + (uint64_t) free_count * sizeof(*free_idx);
+
+    int ok = write_all(fd, header, sizeof(header)) == 0;
+    for (int i = 0; ok && i < npages; i++)
+        ok = write_all(fd, pages[i], ACCT_PAGE * sizeof(struct account)) == 0;
+    ok = ok && write_all(fd, htab, htab_cap * sizeof(struct hslot)) == 0;
+    ok = ok && write_all(fd, free_idx, free_count * sizeof(*free_idx)) == 0;
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, db_path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int init_db(const char* path){
+    if (!path)
+        return htab_resize(64);
+    db_path = strdup(path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        int ret = snapshot_map(fd);
+        close(fd);  // the mapping keeps the file alive
+        if (ret < 0) {
+            // Kept aside for whoever can mend it; the journals are replayed.
+            char bad[4096];
+            snprintf(bad, sizeof(bad), "%s.bad", path);
+            fprintf(stderr, "%s: not a valid account snapshot; moved to %s\n", path, bad);
+            if (rename(path, bad) < 0) {
+                perror(bad);
+                return -1;
+            }
+            if (htab_resize(64) < 0)
+                return -1;
+            journal_gen = journal_first(path);
+        }
+    } else if (errno == ENOENT) {
+        if (htab_resize(64) < 0)
+            return -1;
+        journal_gen = 0;
+    } else {
+        perror(path);
+        return -1;
+    }
+
+    // Replay every journal from the snapshot's generation on; an interrupted
+    // compaction can leave two.
+    uint32_t gen = journal_oldest = journal_gen;
+    int n, last = 0;
+    while ((n = journal_replay(gen)) >= 0) {
+        last = n;
+        gen++;
+    }
+    if (journal_open(gen > journal_oldest ? gen - 1 : gen) < 0)
+        return -1;
+    journal_count = last;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, journal_sync_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+
+    // Tidy up after an interrupted compaction or an oversized journal.
+    if (gen - journal_oldest > 1 || journal_count >= COMPACT_AFTER)
+        db_compact();
+    return 0;
+}
+
+static void compact(){
+    if (!db_path || compact_pid > 0)
+        return;
+    // Later appends go to the next journal; the snapshot covers the rest.
+    if (journal_open(journal_gen + 1) < 0)
+        return;
+    compact_gen = journal_gen;
+    snprintf(snapshot_tmp, sizeof(snapshot_tmp), "%s.tmp", db_path);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return;
+    }
+    if (pid == 0)
+        _exit(snapshot_write(journal_gen) == 0 ? 0 : 1);
+    compact_pid = pid;
+}
+
+void db_compact(){
+    pthread_mutex_lock(&db_lock);
+    compact();
+    pthread_mutex_unlock(&db_lock);
+}
+
+bool db_poll(){
+    int status;
+    bool running;
+    pthread_mutex_lock(&db_lock);
+    if (compact_pid <= 0 || waitpid(compact_pid, &status, WNOHANG) != compact_pid) {
+        running = compact_pid > 0;
+        pthread_mutex_unlock(&db_lock);
+        return running;
+    }
+    compact_pid = -1;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        // Everything in the older journals is in the snapshot now.
+        for (uint32_t gen = journal_oldest; gen < compact_gen; gen++)
+            unlink(journal_name(gen));
+        journal_oldest = compact_gen;
+    } else {
+        fprintf(stderr, "account snapshot failed; journal kept\n");
+    }
+    pthread_mutex_unlock(&db_lock);
+    return false;
+}
+
+bool check_password(int index, const char* password){
+    pthread_mutex_lock(&db_lock);
+    bool ok = strcmp(account_at(index)->password, password) == 0;
+    pthread_mutex_unlock(&db_lock);
+    return ok;
+}
+
+int find_account(const char* username){
+    pthread_mutex_lock(&db_lock);
+    struct hslot *s = htab_probe(username, hash_name(username));
+    int index = s->index >= 0 ? s->index : -1;
+    pthread_mutex_unlock(&db_lock);
+    return index;
+}
+
+static bool create_locked(const char* username, const char* password){
+    uint32_t h = hash_name(username);
+    struct hslot *s = htab_probe(username, h);
+    if (s->index >= 0)
+        return false;  // account already exists
+    // Grown before the insert, so running out of memory refuses it whole.
+    if (s->index == SLOT_EMPTY && (htab_used + 1) * 2 > htab_cap) {
+        if (htab_resize(htab_cap * 2) < 0)
+            return false;
+        s = htab_probe(username, h);
+    }
+
+    int index;
+    if (free_count > 0) {
+        index = free_idx[--free_count];
+    } else {
+        if (size == npages * ACCT_PAGE && expand_db() < 0)
+            return false;
+        index = size++;
+    }
+    struct account *a = account_at(index);
+    strncpy(a->username, username, sizeof(a->username) - 1);
+    strncpy(a->password, password, sizeof(a->password) - 1);
+    a->in_use = 1;
+    a->hash = h;
+
+    if (s->index == SLOT_EMPTY)
+        htab_used++;  // reusing a tombstone doesn't add to the load
+    s->hash = h;
+    s->index = index;
+    journal_append(JOURNAL_CREATE, a);
+    return true;
+}
+
+bool create_account(const char* username, const char* password){
+    pthread_mutex_lock(&db_lock);
+    bool ok = create_locked(username, password);
+    pthread_mutex_unlock(&db_lock);
+    return ok;
+}
+
+static bool del_locked(const char* username){
+    struct hslot *s = htab_probe(username, hash_name(username));
+    if (s->index < 0)
+        return false;
+    if (free_count == free_cap) {
+        int cap = free_cap ? free_cap * 2 : 16;
+        int *idx = realloc(free_idx, sizeof(*idx) * cap);
+        if (!idx)
+            return false;
+        free_idx = idx;
+        free_cap = cap;
+    }
+    free_idx[free_count++] = s->index;
+    journal_append(JOURNAL_DELETE, account_at(s->index));
+    memset(account_at(s->index), 0, sizeof(struct account));
+    s->index = SLOT_DELETED;  // leave a tombstone so probe runs stay intact
+    return true;
+}
+
+bool del_account(const char* username){
+    pthread_mutex_lock(&db_lock);
+    bool ok = del_locked(username);
+    pthread_mutex_unlock(&db_lock);
+    return ok;
+}
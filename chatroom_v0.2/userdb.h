@@ -0,0 +1,34 @@
+#ifndef USERDB_H
+#define USERDB_H
+
+#include <stdbool.h>
+
+#define MAX_USERNAME_LENGTH 15
+#define MAX_PASSWORD_LENGTH 12
+
+/* Initialize the user database. With a path, accounts persist there: the
+ * snapshot is mapped in and its journal replayed, and every change after
+ * that is journaled. NULL keeps everything in memory. Returns -1 on error. */
+int init_db(const char* path);
+
+/* Folds the journal into a fresh snapshot from a forked child, so it never
+ * stalls the caller. Runs automatically as the journal grows. */
+void db_compact();
+// Reaps a finished compaction; returns true while one is still running.
+// Cheap when none is, so it can be called on every loop iteration.
+bool db_poll();
+
+/* Account management functions.
+ * An account keeps its index for as long as it exists, so indices held
+ * elsewhere (a connection's account, colors) stay valid across other deletes. */
+bool create_account(const char* username, const char* password);
+bool del_account(const char* username);
+
+// Returns the account index for username, or -1 if there is none.
+int find_account(const char* username);
+bool check_password(int index, const char* password);
+char* find_username(int index);
+// Number of account indices handed out; deleted ones read back as "".
+int db_size();
+
+#endif
@@ -0,0 +1,147 @@
+#include <string.h>
+#include "wire.h"
+
+#define PAYLOAD_OUT_MAX 0xffff
+
+static uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static unsigned char *put_msg(unsigned char *p, int type, uint32_t sender, const char *s, size_t n)
+{
+    *p++ = type;
+    p = put32(p, sender);
+    *p++ = n >> 8;
+    *p++ = n;
+    memcpy(p, s, n);
+    return p + n;
+}
+
+char *wire_next(struct linebuf *lb, uint32_t *frame_left, char **start, char *end,
+                struct wire_msg *msg)
+{
+    for (;;) {
+        unsigned char *p = (unsigned char *) *start;
+        size_t left = end - *start;
+        if (*frame_left == 0) {
+            if (left < 4)
+                break;
+            *frame_left = get32(p);
+            *start += 4;
+            if (*frame_left > WIRE_FRAME_MAX) {
+                msg->bad = true;
+                return NULL;
+            }
+            continue;
+        }
+        if (*frame_left < WIRE_HEADER) {
+            msg->bad = true;
+            return NULL;
+        }
+        if (left < WIRE_HEADER)
+            break;
+        size_t n = p[5] << 8 | p[6];
+        if (n > WIRE_PAYLOAD_MAX || WIRE_HEADER + n > *frame_left) {
+            msg->bad = true;
+            return NULL;
+        }
+        if (left < WIRE_HEADER + n)
+            break;
+        msg->type = p[0];
+        msg->sender = get32(p + 1);
+        *frame_left -= WIRE_HEADER + n;
+        *start += WIRE_HEADER + n;
+        // The header is spent, so the payload moves over it to make room
+        // for the terminator.
+        char *line = (char *) p;
+        memmove(line, line + WIRE_HEADER, n);
+        line[n] = '\0';
+        line[strcspn(line, "\r\n")] = '\0';
+        return line;
+    }
+    if (*start < end && linebuf_keep(lb, *start, end) < 0)
+        msg->bad = true;
+    *start = end;
+    return NULL;
+}
+
+struct msgbuf *wire_frame(struct msgbuf *m)
+{
+    if (m->kind == WIRE_FRAMED)
+        return m;
+    struct msgbuf *f = atomic_load_explicit(&m->framed, memory_order_acquire);
+    if (f)
+        return f;
+    const char *body = m->kind == WIRE_TEXT ? m->data : m->data + m->body_off;
+    size_t len = m->kind == WIRE_TEXT ? m->len : m->body_len;
+    size_t nmsgs = len ? (len + PAYLOAD_OUT_MAX - 1) / PAYLOAD_OUT_MAX : 1;
+    f = msgbuf_new(4 + nmsgs * WIRE_HEADER + len);
+    if (!f)
+        return NULL;
+    unsigned char *p = put32((unsigned char *) f->data, nmsgs * WIRE_HEADER + len);
+    do {
+        size_t n = len < PAYLOAD_OUT_MAX ? len : PAYLOAD_OUT_MAX;
+        p = put_msg(p, m->kind, m->sender, body, n);
+        body += n;
+        len -= n;
+    } while (len);
+    f->len = p - (unsigned char *) f->data;
+    f->born = m->born;
+
+    // Another shard may have framed it meanwhile; theirs stands.
+    struct msgbuf *none = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&m->framed, &none, f, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        msgbuf_put(f);
+        return none;
+    }
+    return f;
+}
+
+struct msgbuf *wire_history(const struct msgbuf *m)
+{
+    // Each record is a formatted room message, one line apiece.
+    static const char prefix[] = "\033[47m\033[";
+    static const char suffix[] = "\033[0m";
+    size_t lines = 0;
+    for (size_t i = 0; i < m->len; i++)
+        lines += m->data[i] == '\n';
+    struct msgbuf *f = msgbuf_new(4 + lines * WIRE_HEADER + m->len);
+    if (!f)
+        return NULL;
+    unsigned char *p = (unsigned char *) f->data + 4;
+    const char *s = m->data, *end = m->data + m->len;
+    while (s < end) {
+        const char *nl = memchr(s, '\n', end - s);
+        if (!nl)
+            break;
+        const char *text = s, *text_end = nl;
+        if ((size_t) (nl - s) >= sizeof(prefix) - 1 && memcmp(s, prefix, sizeof(prefix) - 1) == 0) {
+            const char *m_end = memchr(s + sizeof(prefix) - 1, 'm', nl - s - (sizeof(prefix) - 1));
+            if (m_end)
+                text = m_end + 1;
+        }
+        if ((size_t) (text_end - text) >= sizeof(suffix) - 1 &&
+            memcmp(text_end - (sizeof(suffix) - 1), suffix, sizeof(suffix) - 1) == 0)
+            text_end -= sizeof(suffix) - 1;
+        size_t n = text_end - text;
+        if (n > PAYLOAD_OUT_MAX)
+            n = PAYLOAD_OUT_MAX;
+        p = put_msg(p, WIRE_CHAT, WIRE_NO_SENDER, text, n);
+        s = nl + 1;
+    }
+    f->len = p - (unsigned char *) f->data;
+    put32((unsigned char *) f->data, f->len - 4);
+    f->kind = WIRE_FRAMED;
+    return f;
+}
@@ -0,0 +1,66 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "linebuf.h"
+#include "sendq.h"
+
+/* Binary framing for machine clients, which a logged-in client switches on
+ * with /binary. From then on both directions carry frames: a 4-byte length
+ * and that many bytes of messages, any number to a frame. A message is a
+ * type byte, a 4-byte sender id, a 2-byte payload length and the payload.
+ * Integers are big-endian.
+ *
+ * From the server, one frame per message (a long WIRE_TEXT may take
+ * several messages), made once and shared by every binary recipient:
+ *   WIRE_TEXT         a reply or notice, as text mode shows it
+ *   WIRE_CHAT         a room message, bare; sender is its account
+ *   WIRE_DIRECT       a /msg to this client, bare; sender is its account
+ *   WIRE_DIRECT_SENT  a /msg from this client; sender is the recipient
+ *   WIRE_PING         a keepalive, with no payload
+ * WIRE_NO_SENDER stands for accounts that can't be told: those of other
+ * nodes, and in /history.
+ *
+ * To the server:
+ *   WIRE_CHAT    a line as text mode takes it, message or command
+ *   WIRE_DIRECT  a /msg to the account in sender
+ * Other types are skipped; a payload ends at its first newline. A frame
+ * over WIRE_FRAME_MAX, or a message that overruns its frame or
+ * WIRE_PAYLOAD_MAX, ends the connection. */
+enum wire_type {
+    WIRE_TEXT,
+    WIRE_CHAT,
+    WIRE_DIRECT,
+    WIRE_DIRECT_SENT,
+    WIRE_PING,
+};
+#define WIRE_NO_SENDER UINT32_MAX
+#define WIRE_FRAMED 0xff    // a msgbuf kind only: the data is a frame already
+#define WIRE_HEADER 7
+// A client's message fits in what linebuf carries between reads.
+#define WIRE_PAYLOAD_MAX (LINE_MAX_LEN - 1 - WIRE_HEADER)
+#define WIRE_FRAME_MAX (1 << 20)
+
+struct wire_msg {
+    int type;
+    uint32_t sender;
+    bool bad;       // the input broke the rules; close the connection
+};
+
+/* Like linebuf_next() for a binary client: the next complete message's
+ * payload, NUL-terminated, with its type and sender in msg. frame_left
+ * carries the unparsed rest of the current frame from call to call. */
+char *wire_next(struct linebuf *lb, uint32_t *frame_left, char **start, char *end,
+                struct wire_msg *msg);
+
+/* m as a frame, made on first use and kept with m, so a broadcast is
+ * framed once; m itself if it is WIRE_FRAMED. The reference stays m's. Returns NULL if out of memory. */
+struct msgbuf *wire_frame(struct msgbuf *m);
+
+// A room_history() buffer as a frame of WIRE_CHAT messages, kind WIRE_FRAMED.
+struct msgbuf *wire_history(const struct msgbuf *m);
+
+#endif